@@ -0,0 +1,32 @@
+/*** bench helpers ***/
+
+// Shared by the benchmarks, include after kilo.c
+
+#include <sys/time.h>
+
+typedef struct benchgen { // state of the text generator, carried across calls
+  unsigned int seed;
+  size_t col;
+} benchgen;
+
+
+double benchNow() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+void benchFill(benchgen *g, char *buf, size_t len) { // lines of pseudo random words, like a log file
+  for (size_t j = 0; j < len; j++) {
+    g->seed = g->seed * 1103515245 + 12345;
+    int r = (g->seed >> 16) % 32;
+    if (g->col > 40 && r == 0) {
+      buf[j] = '\n';
+      g->col = 0;
+      continue;
+    }
+    buf[j] = r < 5 ? ' ' : 'a' + r % 26;
+    g->col++;
+  }
+}
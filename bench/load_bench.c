@@ -0,0 +1,55 @@
+/*** load benchmark ***/
+
+// Measures how fast editorOpen indexes a file, next to how fast the same
+// file can merely be read back from the page cache. Build with
+// `make bench`, run as ./load_bench.ex [megabytes]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include "bench.h"
+
+
+void benchWrite(int fd, size_t len) { // the generated text, written out a chunk at a time
+  char buf[1 << 16];
+  benchgen g = {12345, 0};
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    benchFill(&g, buf, n);
+    if (write(fd, buf, n) != (ssize_t)n)
+      die("write");
+    len -= n;
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 128;
+  size_t len = mb << 20;
+
+  char path[] = "/tmp/kilo_load_benchXXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1)
+    die("mkstemp");
+  benchWrite(fd, len);
+
+  char *buf = malloc(1 << 20); // a plain read of the whole file sets the bar
+  double start = benchNow();
+  lseek(fd, 0, SEEK_SET);
+  while (read(fd, buf, 1 << 20) > 0)
+    ;
+  double readsecs = benchNow() - start;
+  free(buf);
+  close(fd);
+
+  start = benchNow();
+  editorOpen(path);
+  double opensecs = benchNow() - start;
+  unlink(path);
+
+  printf("%zu MB, %d lines, %s, %ld cores\n", mb, E.numrows,
+      E.huge ? "folded" : "rows made", sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-28s %8.2f GB/s\n", "read into a buffer", len / readsecs / 1e9);
+  printf("%-28s %8.2f GB/s\n", "editorOpen", len / opensecs / 1e9);
+  return 0;
+}
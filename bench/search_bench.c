@@ -0,0 +1,84 @@
+/*** search benchmark ***/
+
+// Measures the Ctrl-F search kernel. Build with `make bench`, run as
+// ./search_bench.ex [megabytes]
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#include "bench.h"
+
+
+char *benchText(size_t len) { // the generated text in one nul terminated buffer
+  char *buf = malloc(len + 1);
+  if (buf == NULL)
+    die("malloc");
+
+  benchgen g = {12345, 0};
+  benchFill(&g, buf, len);
+  buf[len] = '\0';
+  return buf;
+}
+
+
+void benchRun(const char *name, char *text, size_t len, const char *needle, int rows) {
+  size_t m = strlen(needle);
+  int reps = 5;
+  long found = 0;
+
+  double start = benchNow();
+  for (int r = 0; r < reps; r++) {
+    if (rows) { // one call per line, the way the find code walks rows
+      char *p = text;
+      char *end = text + len;
+      while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        size_t linelen = (nl ? nl : end) - p;
+        if (rows == 1)
+          found += editorSearchMem(p, linelen, needle, m) != NULL;
+        else { // the old strstr over a nul terminated line
+          char save = p[linelen];
+          p[linelen] = '\0';
+          found += strstr(p, needle) != NULL;
+          p[linelen] = save;
+        }
+        p = nl ? nl + 1 : end;
+      }
+    }
+    else { // every match in one buffer
+      char *p = text;
+      char *end = text + len;
+      while ((p = editorSearchMem(p, end - p, needle, m)) != NULL) {
+        found++;
+        p++;
+      }
+    }
+  }
+  double secs = benchNow() - start;
+
+  printf("%-28s %-10s %8.2f GB/s  (%ld hits)\n", name, needle,
+      (double)len * reps / secs / 1e9, found / reps);
+}
+
+
+int main(int argc, char *argv[]) {
+  size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 256;
+  size_t len = mb << 20;
+  char *text = benchText(len);
+
+#ifdef __SSE2__
+  printf("kernel: sse2 first/last byte filter, %zu MB buffer\n", mb);
+#else
+  printf("kernel: memchr scan, %zu MB buffer\n", mb);
+#endif
+
+  const char *needles[] = { "zq", "kilo", "editorsearch", NULL };
+  for (int j = 0; needles[j]; j++) {
+    benchRun("contiguous buffer", text, len, needles[j], 0);
+    benchRun("per row, editorSearchMem", text, len, needles[j], 1);
+    benchRun("per row, strstr", text, len, needles[j], 2);
+  }
+
+  free(text);
+  return 0;
+}
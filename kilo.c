@@ -1,23 +1,53 @@
 /*** includes ***/
 
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "1.0.0"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_HL_CHECKPOINT 128 // rows between saved comment states
+#define KILO_HL_BUDGET 20000    // rows a frame may walk to settle comment states
+#define KILO_HL_THREADS 16      // most threads settling comment states at once
+#define KILO_INPUT_RING 4096    // bytes of input buffered ahead of parsing, a power of two
+#define KILO_ESC_TIMEOUT 100    // ms to wait for the rest of an escape sequence
+#define KILO_PASTE_TIMEOUT 1000 // ms a paste may stall before it is taken as finished
+#define KILO_FRAME_MS 16        // least ms between frames while input is queued
+#define KILO_SAVE_IOV 1024      // most pieces handed to one writev
+#define KILO_UNDO_BUDGET (32 << 20) // bytes of undo history kept
+#define KILO_HUGE_BYTES (256LL << 20) // files larger than this open folded
+#define KILO_HUGE_FOLD (1 << 20)      // bytes of the file a leaf folds at open
+#define KILO_HUGE_WINDOW 4096         // rows kept made around the view before refolding
+#define KILO_LOAD_CHUNK (16 << 20) // least bytes of the file each loading thread indexes
+#define KILO_LOAD_THREADS 16       // most threads indexing a file at open
+#define KILO_RCACHE_ROWS 4096       // most rows kept rendered
+#define KILO_RCACHE_BYTES (8 << 20) // most bytes of render and hl kept
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -31,7 +61,9 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START, // bracketed paste markers
+  PASTE_END
 };
 
 enum editorHighlight {
@@ -45,11 +77,22 @@ enum editorHighlight {
   HL_MATCH
 };
 
+enum editorUndoKind {
+  UNDO_INSERT = 1,
+  UNDO_DELETE
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
 /*** data ***/
 
+typedef struct editorKeyword { // slot in a syntax's keyword hash
+  char *word; // NULL marks an empty slot
+  int len;
+  unsigned char hl;
+} editorKeyword;
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -58,18 +101,193 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  editorKeyword *kwtable; // keywords hashed on first use
+  unsigned int kwmask;
 };
 
-typedef struct erow { // a row of a file
-  int idx;
-  int size;
-  int rsize;
+typedef struct erow { // a row of a file, 64 of them share a leaf
   char *chars;
-  char *render;
-  unsigned char *hl; // designates type of highlighting
-  int hl_open_comment;
+  int size;
+  int cap;   // bytes allocated for chars, grown geometrically
+  int savegen; // chars are shared with the running save if this is its gen
+  int rslot; // render cache entry holding render and hl, while it still has rtag
+  unsigned int rtag; // 0 until the row is first displayed
+  unsigned char mapped; // chars points into E.map until the row is edited
+  unsigned char hl_open_comment;
+  unsigned char hl_start; // comment state the row was last lexed from
+  unsigned char hl_valid; // 0 unknown, 1 hl_open_comment known, 2 hl in the cache lexed too
 } erow;
 
+#define ROW_HLBYTES(cells) (((cells) + 1) / 2) // hl packs two cells a byte
+
+typedef struct rcentry { // render and hl of a recently displayed row
+  char *block;  // render then hl, or only hl when render is the row's chars
+  int rsize;
+  int cap;      // cells the block has room for
+  int alias;    // the row has no tabs, so it renders to its own chars
+  unsigned int tag; // handed to the row owning the entry, 0 while free
+  int prev, next; // lru order, -1 at either end
+} rcentry;
+
+typedef struct rendercache { // rows displayed lately, the rest are rendered again when shown
+  rcentry *e; // KILO_RCACHE_ROWS entries, made on first use
+  int head, tail; // most and least recently used, -1 if empty
+  int free; // first free entry, chained through next
+  int n;
+  long long bytes; // held by the blocks
+  unsigned int tag; // last tag handed out
+} rendercache;
+
+#define ROWTREE_FANOUT 64
+
+typedef struct rownode { // counted b+ tree node, rows live in the leaves
+  int leaf;
+  int n;     // rows in a leaf, children in an inner node
+  int count; // rows stored beneath this node
+  struct rownode *prev, *next; // neighbouring leaves
+  char *fold;     // a folded leaf stands for count lines of the mapping and
+  size_t foldlen; // holds no rows until one of them is needed
+  union {
+    struct rownode *child[ROWTREE_FANOUT];
+    erow row[ROWTREE_FANOUT];
+  } u;
+} rownode;
+
+typedef struct rowiter { // walks rows in order along the leaf chain
+  rownode *leaf;
+  int i;
+} rowiter;
+
+typedef struct loadchunk { // a stretch of the file indexed on its own thread at open
+  char *p, *end;         // both at line starts
+  int huge;              // make folded leaves instead of rows
+  rownode *first, *last; // leaves made, linked to each other
+  int leaves;
+  int rows;
+} loadchunk;
+
+typedef struct hlchunk { // checkpoints settled on one thread before the state they start in is known
+  int from, to;             // lexes rows from checkpoint from up to checkpoint to
+  unsigned char *states[2]; // states at checkpoints from + 1 to to, starting outside or inside a comment
+} hlchunk;
+
+typedef struct findjob { // what the search worker scans, fixed while it runs
+  char *query;
+  int qlen;
+  int spacey;    // query has a space, so tabs must be expanded before matching
+  int numrows;
+  int *cand;     // rows to recheck when narrowing, NULL to scan every row
+  int ncand;
+} findjob;
+
+typedef struct findset { // rows holding the current search query
+  char *query; // NULL when no search is running
+  int *rows;   // ascending
+  int n;
+  int cap;
+  int cur;     // index in rows of the highlighted match, -1 before the first jump
+  int done;    // every row has been searched, rows is complete
+  findjob job;
+  pthread_t worker;
+  int running; // worker started and not joined yet
+  int wake[2]; // pipe the worker pokes when it publishes rows
+  pthread_mutex_t lock; // guards the fields below, shared with the worker
+  int cancel;
+  int finished;
+  int *found;  // rows published by the worker, not merged into rows yet
+  int nfound;
+  int foundcap;
+} findset;
+
+typedef struct inputring { // input read in bulk, parsed into keys a byte at a time
+  unsigned char buf[KILO_INPUT_RING];
+  unsigned int head; // next byte to parse, counts up and wraps
+  unsigned int tail; // one past the last byte read
+} inputring;
+
+typedef struct screencell { // one character cell of the terminal
+  char ch;               // 0 for a cell whose contents are unknown
+  unsigned char color;   // sgr foreground, 39 is the default
+  unsigned char inverse;
+} screencell;
+
+typedef struct savespan { // bytes of the file as it was when a save began
+  char *chars;
+  size_t len;
+  int newline; // a \n that is not in chars follows
+  int fold;    // whole lines of the mapping, written a line at a time if any ends in \r
+} savespan;
+
+typedef struct savebatch { // pieces of the file gathered for one writev
+  int fd;
+  struct iovec iov[KILO_SAVE_IOV];
+  int n;
+  long long len;     // bytes in the pieces
+  long long written; // bytes out before them
+  int ok;
+} savebatch;
+
+typedef struct savejob { // a save running on its own thread
+  int gen;       // rows whose savegen matches share their chars with spans
+  int running;   // thread started and not joined yet
+  pthread_t thread;
+  char *path;
+  savespan *spans;
+  int nspans;
+  int spancap;
+  long long total; // bytes the saved file will hold, less the \r CRLF folds drop
+  int dirty;       // E.dirty when the snapshot was taken
+  int progress;    // percent written, as last shown
+  char **retired;  // chars edits let go of while the save still reads them
+  int nretired;
+  int retiredcap;
+  int wake[2];     // pipe the save thread pokes as it makes progress
+  pthread_mutex_t lock; // guards the fields below, shared with the save thread
+  long long written;
+  int finished;
+  int error;       // errno of a failed save, 0 if it worked
+} savejob;
+
+typedef struct undoop { // an edit in the undo journal, its text follows it
+  unsigned char kind;   // UNDO_INSERT or UNDO_DELETE
+  unsigned char append; // the text began on a row added past the last one
+  int len;    // bytes of text, rows joined by \n
+  int y, x;   // where the text starts
+  int y2, x2; // where it ends
+  int cy, cx; // cursor before the edit
+} undoop;
+
+typedef struct undojournal { // edits that can be undone, then those that can be redone
+  char *arena; // records back to back, each an undoop, its text and its size
+  size_t len;
+  size_t cap;
+  size_t cur;  // end of the last record applied, redo records follow
+  int merge;   // the record before cur may still take the next keystroke
+} undojournal;
+
+typedef struct swapheader { // start of a swap file, names the file its edits apply to
+  char magic[8];
+  long long size;  // of the file the edits start from, -1 if it did not exist
+  long long mtime; // its modification time in ns
+} swapheader;
+
+typedef struct swapjournal { // edits since the last save, kept on disk for crash recovery
+  char *path;        // NULL when nothing is journaled
+  int fd;            // owned by the writer once it runs
+  long long logged;  // bytes of header and records handed to the writer
+  long long snapoff; // logged when the running save took its snapshot
+  pthread_t writer;
+  pthread_mutex_t lock; // guards the fields below, shared with the writer
+  pthread_cond_t cond;
+  char *buf;         // records the writer has not picked up yet
+  size_t len;
+  size_t cap;
+  int busy;          // the writer is out writing a batch
+  int rebase;        // a save landed, restart the file from rebasefrom
+  long long rebasefrom;
+  swapheader base;   // header for the restarted file
+  int quit;
+} swapjournal;
 
 struct editorConfig { // global config data
   int cx, cy;
@@ -79,12 +297,36 @@ struct editorConfig { // global config data
   int screenrows;
   int screencols;
   int numrows;
-  erow *row;
+  rownode *rows; // root of the row tree
+  char *map; // read only mapping of the opened file
+  size_t maplen;
+  int huge;     // rows are only made from the mapping around the view
+  int unfolded; // rows made from folded leaves since the last refold
+  pthread_rwlock_t rowlock; // held to fold or unfold leaves while the search worker reads them
   int dirty;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  findset find;
+  savejob save;
+  undojournal undo;
+  swapjournal swap;
+  rendercache rcache;
+  unsigned char *hl_check; // comment state at the start of every KILO_HL_CHECKPOINT rows
+  int hl_checkvalid;       // leading checkpoints that are still correct
+  int hl_checkcap;
+  int hl_budget; // rows editorRowStartState may still walk before guessing
+  int hl_wanted; // furthest row drawn with a guessed state, -1 if none
+  int hl_cores;  // threads settling comment states, 0 until counted
+  screencell *screen; // what the terminal is showing
+  screencell *frame;  // the frame being drawn
+  int screenh, screenw; // size the cell grids were made for
+  int cursory, cursorx; // where the terminal cursor was left
+  int screenrowoff;     // rowoff of the frame the terminal is showing
+  inputring input;
+  int winch[2]; // pipe the SIGWINCH handler pokes to wake the event loop
+  long long lastframe; // ms timestamp of the last refresh
   struct termios orig_termios; // default values of terminal
 };
 
@@ -107,7 +349,8 @@ struct editorSyntax HLDB[] = {
     C_HL_extensions,
     C_HL_keywords,
     "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL, 0
   },
 };
 
@@ -117,6 +360,14 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+int editorSyntaxIdle();
+int editorFindIdle();
+int editorSaveIdle();
+void editorUndoInsert(int y, int x, int append, char *s, int len);
+void editorUndoDelete(int y, int x, int y2, int x2, char *s, int len);
+void editorSwapLog(int kind, int append, int y, int x, int y2, int x2, char *s, int len);
+void editorSwapStart(int ondisk);
+void editorSwapSaved();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 /*** terminal ***/
@@ -131,6 +382,7 @@ void die(const char *s) {  // error handling
 
 
 void disableRawMode() {  //puts terminal into raw mode
+  write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) // catch terminal attribute errors
     die("tcsetattr");
 }
@@ -149,72 +401,58 @@ void enableRawMode() {  //puts terminal into raw mode
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);        //sets raw input flag | canoncial flag | disable literal input | siginit/sigtstp
 
-  // indexes for c_cc field which controls behavior of read, sets timeout to 1/10 of a sec
+  // reads never wait, poll does all the waiting
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)    //catch terminal attribute errors
     die("tcsetattr");
+
+  write(STDOUT_FILENO, "\x1b[?2004h", 8); // pastes arrive between PASTE_START and PASTE_END
 }
 
 
-int editorReadKey() {  // waits and reads in a valid char and returns it
-  int nread;
-  char c;
+int editorIdle() { // background work between keys, 1 if the screen should be redrawn
+  int redraw = editorSyntaxIdle();
+  redraw |= editorFindIdle();
+  redraw |= editorSaveIdle();
+  return redraw;
+}
+
+
+void editorInputFill() { // read everything waiting on stdin into the ring, one read per burst
+  for (int j = 0; j < 2; j++) { // the free space may wrap around the end
+    unsigned int used = E.input.tail - E.input.head;
+    unsigned int at = E.input.tail & (KILO_INPUT_RING - 1);
+    unsigned int room = KILO_INPUT_RING - used;
+    if (room > KILO_INPUT_RING - at)
+      room = KILO_INPUT_RING - at;
+    if (room == 0)
+      return;
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    int nread = read(STDIN_FILENO, &E.input.buf[at], room);
     if (nread == -1 && errno != EAGAIN)
       die("read");
+    if (nread <= 0)
+      return;
+    E.input.tail += nread;
+    if ((unsigned int)nread < room)
+      return;
   }
+}
 
-  if (c == '\x1b') {// arrow keys behave like wasd
-    char seq[3];
-
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) 
-      return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) 
-      return '\x1b';
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') { // handles pageup, pagedown
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
-          return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        }
-      }
-      else { 
-        switch (seq[1]) { // handes arrow key input
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
-        }
-      }
-    }
-    else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
-      }
-    }
 
-    return '\x1b';
-  }
-  else {
-    return c;
+int editorInputByte(int timeout) { // next input byte, -1 if none comes within timeout ms
+  if (E.input.head == E.input.tail) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) <= 0)
+      return -1;
+    editorInputFill();
+    if (E.input.head == E.input.tail)
+      return -1;
   }
+  return E.input.buf[E.input.head++ & (KILO_INPUT_RING - 1)];
 }
 
 
@@ -226,8 +464,10 @@ int getCursorPosition(int *rows, int *cols) { // get positon of cursor in termin
     return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i] , 1) != 1)
+    int c = editorInputByte(KILO_ESC_TIMEOUT);
+    if (c == -1)
       break;
+    buf[i] = c;
     if (buf[i] == 'R') 
       break;
     i++;  
@@ -258,497 +498,3236 @@ int getWindowSize(int *rows, int *cols) { // gets size of terminal
   }
 }
 
-/*** syntax highlighting ***/
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+void editorHandleSigWinch(int sig) { // only wakes the event loop, which does the resize
+  (void)sig;
+  int saved_errno = errno;
+  write(E.winch[1], "", 1);
+  errno = saved_errno;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
 
-  if (E.syntax == NULL)
+void editorResize() { // pick up the terminal's new size
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1 || rows < 3 || cols < 1)
     return;
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+}
 
-  char **keywords = E.syntax->keywords;
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+int editorInputPending() { // 1 if input is already waiting to be parsed
+  if (E.input.head != E.input.tail)
+    return 1;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  if (poll(&pfd, 1, 0) <= 0)
+    return 0;
+  editorInputFill();
+  return E.input.head != E.input.tail;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+long long editorNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
+void editorRunChunks(void *(*work)(void *), void *chunks, size_t size, int n) { // work on n chunks of size bytes at once
+  pthread_t threads[n];
+  int started[n];
+  char *c = chunks;
+  for (int i = 1; i < n; i++) // the first chunk is done here meanwhile
+    started[i] = pthread_create(&threads[i], NULL, work, c + i * size) == 0;
+  work(c);
+  for (int i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else // no thread to be had, do it here
+      work(c + i * size);
+  }
+}
+
+
+int editorFrameDue() { // draw now, unless more keys are queued and the last frame is recent
+  // the queue always drains eventually, so the frame after the last key
+  // is drawn as soon as it is handled
+  if (!editorInputPending())
+    return 1;
+  return editorNowMs() - E.lastframe >= KILO_FRAME_MS;
+}
+
+
+void editorWaitInput() { // sleep until input arrives, handling resizes and background work meanwhile
+  while (E.input.head == E.input.tail) {
+    struct pollfd pfd[4] = { // poll skips the negative fds of idle workers
+      {STDIN_FILENO, POLLIN, 0},
+      {E.winch[0], POLLIN, 0},
+      {E.find.running ? E.find.wake[0] : -1, POLLIN, 0}, // a search wakes us with results
+      {E.save.running ? E.save.wake[0] : -1, POLLIN, 0}, // and a save with progress
+    };
+    // with work queued only check for events, otherwise sleep until one
+    if (poll(pfd, 4, E.hl_wanted >= 0 ? 0 : -1) == -1 && errno != EINTR)
+      die("poll");
+
+    if (pfd[1].revents & POLLIN) {
+      char buf[64];
+      while (read(E.winch[0], buf, sizeof(buf)) > 0)
+        ;
+      editorResize();
+      editorRefreshScreen();
     }
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        }
-        else {
-          i++;
-          continue;
-        }
-      }
-      else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      editorInputFill();
+      if (E.input.head == E.input.tail && (pfd[0].revents & POLLHUP))
+        die("read");
     }
+    else if (editorIdle()) {
+      editorRefreshScreen();
+    }
+  }
+}
 
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
+int editorReadKey() {  // waits and reads in a valid char and returns it
+  editorWaitInput();
+  char c = editorInputByte(0);
+
+  if (c == '\x1b') {// arrow keys behave like wasd
+    int seq[3];
+
+    if ((seq[0] = editorInputByte(KILO_ESC_TIMEOUT)) == -1)
+      return '\x1b';
+    if ((seq[1] = editorInputByte(KILO_ESC_TIMEOUT)) == -1)
+      return '\x1b';
+
+    if (seq[0] == '[') {
+      if (seq[1] >= '0' && seq[1] <= '9') { // handles pageup, pagedown, paste markers
+        int num = seq[1] - '0';
+        while ((seq[2] = editorInputByte(KILO_ESC_TIMEOUT)) >= '0' && seq[2] <= '9')
+          num = num * 10 + seq[2] - '0';
+        if (seq[2] == -1)
+          return '\x1b';
+        if (seq[2] == '~') {
+          switch (num) {
+            case 1: return HOME_KEY;
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+            case 200: return PASTE_START;
+            case 201: return PASTE_END;
+          }
         }
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
       }
-      else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
+      else { 
+        switch (seq[1]) { // handes arrow key input
+          case 'A': return ARROW_UP;
+          case 'B': return ARROW_DOWN;
+          case 'C': return ARROW_RIGHT;
+          case 'D': return ARROW_LEFT;
+          case 'H': return HOME_KEY;
+          case 'F': return END_KEY;
         }
       }
     }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
-
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
+    else if (seq[0] == 'O') {
+      switch (seq[1]) {
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
       }
     }
 
-    prev_sep = is_separator(c);
-    i++;
+    return '\x1b';
   }
+  else {
+    return c;
+  }
+}
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+/*** render cache ***/
+
+rcentry *rowCacheGet(erow *row) { // the row's entry, NULL if it has none or it was evicted
+  if (row->rtag == 0)
+    return NULL;
+  rcentry *e = &E.rcache.e[row->rslot];
+  if (e->tag == row->rtag)
+    return e;
+  row->rtag = 0; // the hl went with it, the state the row ends in is still known
+  if (row->hl_valid == 2)
+    row->hl_valid = 1;
+  return NULL;
 }
 
-int editorSyntaxToColor(int hl) {
-  switch(hl) {
-    case HL_NUMBER: return 31;
-    case HL_KEYWORD2: return 32;
-    case HL_KEYWORD1: return 33;
-    case HL_MATCH: return 34;
-    case HL_STRING: return 35;
-    case HL_COMMENT:
-    case HL_MLCOMMENT: return 36;
-    default: return 37;
-  }
+
+char *rowCacheRender(erow *row, rcentry *e) {
+  return e->alias ? row->chars : e->block;
 }
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
-  if (E.filename == NULL)
+
+unsigned char *rowCacheHl(rcentry *e) { // packed highlight classes, right after render
+  return (unsigned char *)e->block + (e->alias ? 0 : e->cap);
+}
+
+
+long long rowCacheBlock(rcentry *e) { // bytes the entry's block takes
+  return (e->alias ? 0 : e->cap) + ROW_HLBYTES(e->cap);
+}
+
+
+void rowCacheUnlink(rcentry *e) {
+  rendercache *c = &E.rcache;
+  if (e->prev != -1)
+    c->e[e->prev].next = e->next;
+  else
+    c->head = e->next;
+  if (e->next != -1)
+    c->e[e->next].prev = e->prev;
+  else
+    c->tail = e->prev;
+}
+
+
+void rowCacheLink(rcentry *e) { // makes e the most recently used
+  rendercache *c = &E.rcache;
+  int i = e - c->e;
+  e->prev = -1;
+  e->next = c->head;
+  if (c->head != -1)
+    c->e[c->head].prev = i;
+  else
+    c->tail = i;
+  c->head = i;
+}
+
+
+void rowCacheTouch(rcentry *e) {
+  if (E.rcache.head == e - E.rcache.e)
     return;
+  rowCacheUnlink(e);
+  rowCacheLink(e);
+}
 
-  char *ext = strrchr(E.filename, '.');
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+void rowCacheFree(rcentry *e) { // evicts e, its row finds out from the stale tag
+  rendercache *c = &E.rcache;
+  rowCacheUnlink(e);
+  c->bytes -= rowCacheBlock(e);
+  free(e->block);
+  e->block = NULL;
+  e->tag = 0;
+  e->next = c->free;
+  c->free = e - c->e;
+  c->n--;
+}
 
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
-        }
 
-        return;
-      }
-      i++;
+void rowCacheDrop(erow *row) { // the row is being freed or folded
+  rcentry *e = rowCacheGet(row);
+  if (e)
+    rowCacheFree(e);
+  row->rtag = 0;
+  if (row->hl_valid == 2)
+    row->hl_valid = 1;
+}
+
+
+rcentry *rowCacheReserve(erow *row, int need, int alias) { // the row's entry, room for need cells, hl kept
+  rendercache *c = &E.rcache;
+  if (c->e == NULL) {
+    c->e = malloc(sizeof(rcentry) * KILO_RCACHE_ROWS);
+    if (c->e == NULL)
+      die("malloc");
+    for (int i = 0; i < KILO_RCACHE_ROWS; i++) {
+      c->e[i].block = NULL;
+      c->e[i].tag = 0;
+      c->e[i].next = i + 1 < KILO_RCACHE_ROWS ? i + 1 : -1;
     }
+    c->free = 0;
+    c->head = -1;
+    c->tail = -1;
   }
-}
 
-/*** row operations ***/
+  rcentry *e = rowCacheGet(row);
+  if (e == NULL) {
+    if (c->free == -1) // full, the least recently shown row goes
+      rowCacheFree(&c->e[c->tail]);
+    e = &c->e[c->free];
+    c->free = e->next;
+    c->n++;
+    if (++c->tag == 0) // 0 marks a row without an entry
+      c->tag = 1;
+    e->tag = c->tag;
+    e->rsize = 0;
+    e->cap = 0;
+    e->alias = alias;
+    rowCacheLink(e);
+    row->rslot = e - c->e;
+    row->rtag = e->tag;
+  }
+  else {
+    rowCacheTouch(e);
+  }
 
-int editorRowCxToRx(erow *row, int cx) { // adjusts cx for tabs -> rx
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
+  if (need > e->cap || alias != e->alias) {
+    int cap = need <= e->cap ? e->cap : need > e->cap * 2 ? need : e->cap * 2;
+    char *block = malloc((alias ? 0 : cap) + ROW_HLBYTES(cap));
+    if (block == NULL)
+      die("malloc");
+    if (e->block && !alias && !e->alias) // render up to the edit is reused
+      memcpy(block, e->block, e->rsize);
+    if (e->block) // hl moves behind the render, if there is one now
+      memcpy(block + (alias ? 0 : cap), rowCacheHl(e), ROW_HLBYTES(e->cap));
+    c->bytes -= rowCacheBlock(e);
+    free(e->block);
+    e->block = block;
+    e->cap = cap;
+    e->alias = alias;
+    c->bytes += rowCacheBlock(e);
   }
-  return rx;
+
+  while (c->bytes > KILO_RCACHE_BYTES && c->tail != e - c->e) // long rows bound it before the count does
+    rowCacheFree(&c->e[c->tail]);
+  return e;
 }
 
+/*** row tree ***/
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) { // loop through acccumulating cur_rx for conversion
-    if (row->chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx)
-      return cx;
+rownode *rowNodeNew(int leaf) {
+  rownode *node = calloc(1, sizeof(rownode));
+  if (node == NULL)
+    die("calloc");
+  node->leaf = leaf;
+  return node;
+}
+
+
+int rowNodeChild(rownode *node, int *at) { // child holding row *at, made relative
+  int i;
+  if (*at >= node->count / 2) { // count from the back, appends land here
+    int rest = node->count - *at;
+    for (i = node->n - 1; i > 0; i--) {
+      if (rest <= node->u.child[i]->count)
+        break;
+      rest -= node->u.child[i]->count;
+    }
+    *at = node->u.child[i]->count - rest;
+    return i;
   }
-  return cx; // if out of range
+
+  for (i = 0; i < node->n - 1; i++) {
+    if (*at < node->u.child[i]->count)
+      break;
+    *at -= node->u.child[i]->count;
+  }
+  return i;
 }
 
 
-void editorUpdateRow(erow *row) { // handles rendering special characters like tab
- // free(row->render);
-  //row->render = malloc(row->size + 1);
+void rowMapSpan(erow *row, char *p, char *eol) { // borrow the line from p to its end of line as row
+  size_t linelen = eol - p;
+  while (linelen > 0 && (p[linelen - 1] == '\n' || p[linelen - 1] == '\r'))
+    linelen--;
 
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
-  
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+  memset(row, 0, sizeof(*row));
+  row->size = linelen;
+  row->chars = p;
+  row->mapped = 1;
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) { // inster 8 spaces for tabs
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    }
-    else {
-      row->render[idx++] = row->chars[j];
+
+char *rowMapLine(erow *row, char *p, char *end) { // borrow the line at p as row, returns the next line
+  char *nl = memchr(p, '\n', end - p);
+  rowMapSpan(row, p, nl ? nl : end);
+  return nl ? nl + 1 : end;
+}
+
+
+int rowScanLines(char *p, char *end, char **nls, int max) { // finds up to max newlines from p on, returns how many
+  // lines are short, so finding them one memchr at a time is mostly call
+  // overhead; a block of 16 bytes is checked at once instead
+  int k = 0;
+#ifdef __SSE2__
+  __m128i nl = _mm_set1_epi8('\n');
+  while (k < max && end - p >= 16) {
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+    while (mask && k < max) {
+      nls[k++] = p + __builtin_ctz(mask);
+      mask &= mask - 1;
     }
+    p += 16;
   }
-  
-  row->render[idx] = '\0';
-  row->rsize = idx;
+#endif
 
-  editorUpdateSyntax(row);
+  while (k < max) { // the tail and non-sse2 builds
+    char *nlp = memchr(p, '\n', end - p);
+    if (nlp == NULL)
+      break;
+    nls[k++] = nlp;
+    p = nlp + 1;
+  }
+  return k;
 }
 
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) // verify the value of at is valid
-    return;
+int rowCountLines(char *p, char *end) { // rows rowMapLine would make of [p, end)
+  int n = 0;
+  int last = p < end && end[-1] != '\n'; // a line without a newline still makes a row
+#ifdef __SSE2__
+  __m128i nl = _mm_set1_epi8('\n');
+  for (; end - p >= 64; p += 64) {
+    unsigned int a = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+    unsigned int b = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), nl));
+    unsigned int c = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), nl));
+    unsigned int d = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), nl));
+    n += __builtin_popcount(a | b << 16) + __builtin_popcount(c | d << 16);
+  }
+#endif
+
+  char *nlp;
+  while ((nlp = memchr(p, '\n', end - p)) != NULL) {
+    n++;
+    p = nlp + 1;
+  }
+  return n + last;
+}
+
+
+char *rowFoldLine(rownode *leaf, int i) { // start of line i of a folded leaf
+  char *p = leaf->fold;
+  while (i-- > 0)
+    p = (char *)memchr(p, '\n', leaf->fold + leaf->foldlen - p) + 1;
+  return p;
+}
+
+
+rownode *rowTreeLeaf(int *at) { // leaf holding row *at, made relative
+  rownode *node = E.rows;
+  while (!node->leaf)
+    node = node->u.child[rowNodeChild(node, at)];
+  return node;
+}
+
+
+rowiter rowIterAt(int at) { // leaves folded leaves folded, it.i counts lines in them
+  rowiter it = {NULL, 0};
+  if (at < 0 || at >= E.numrows)
+    return it;
+
+  it.leaf = rowTreeLeaf(&at);
+  it.i = at;
+  return it;
+}
+
+
+void rowIterSkip(rowiter *it, int n) { // steps past n rows, a leaf at a time
+  while (it->leaf && it->i + n >= it->leaf->count) {
+    n -= it->leaf->count - it->i;
+    it->leaf = it->leaf->next;
+    it->i = 0;
+  }
+  if (it->leaf)
+    it->i += n;
+}
+
+
+rownode *rowIterLeaf(rowiter *it) { // leaf of the current row, NULL past the end
+  while (it->leaf && it->i >= it->leaf->count) {
+    it->leaf = it->leaf->next;
+    it->i = 0;
+  }
+  return it->leaf;
+}
+
+
+erow *rowIterNext(rowiter *it) { // returns the current row and steps past it, NULL at a fold
+  rownode *leaf = rowIterLeaf(it);
+  if (leaf == NULL || leaf->fold)
+    return NULL;
+  return &leaf->u.row[it->i++];
+}
+
+
+rownode *rowNodeSplit(rownode *node) { // moves the upper half into a new sibling
+  rownode *sib = rowNodeNew(node->leaf);
+  int half = node->n / 2;
+  sib->n = node->n - half;
+  node->n = half;
+
+  if (node->leaf) {
+    memcpy(sib->u.row, &node->u.row[half], sizeof(erow) * sib->n);
+    sib->count = sib->n;
+    node->count = node->n;
+
+    sib->next = node->next;
+    sib->prev = node;
+    if (node->next)
+      node->next->prev = sib;
+    node->next = sib;
+  }
+  else {
+    memcpy(sib->u.child, &node->u.child[half], sizeof(rownode *) * sib->n);
+    for (int j = 0; j < sib->n; j++)
+      sib->count += sib->u.child[j]->count;
+    node->count -= sib->count;
+  }
+  return sib;
+}
+
+
+rownode *rowNodeAdopt(rownode *node, int i, rownode *split) { // puts split after child i, returns new sibling on split
+  rownode *sib = NULL;
+  if (node->n == ROWTREE_FANOUT) {
+    sib = rowNodeSplit(node);
+    if (i >= node->n) {
+      i -= node->n;
+      node->count -= split->count;
+      sib->count += split->count;
+      node = sib;
+    }
+  }
+  memmove(&node->u.child[i + 2], &node->u.child[i + 1], sizeof(rownode *) * (node->n - i - 1));
+  node->u.child[i + 1] = split;
+  node->n++;
+  return sib;
+}
+
+
+rownode *rowNodeInsert(rownode *node, int at, erow *row) { // returns new sibling on split
+  if (node->leaf) {
+    rownode *sib = NULL;
+    if (node->n == ROWTREE_FANOUT) {
+      sib = rowNodeSplit(node);
+      if (at > node->n) {
+        at -= node->n;
+        node = sib;
+      }
+    }
+    memmove(&node->u.row[at + 1], &node->u.row[at], sizeof(erow) * (node->n - at));
+    node->u.row[at] = *row;
+    node->n++;
+    node->count++;
+    return sib;
+  }
+
+  int i = rowNodeChild(node, &at);
+  rownode *split = rowNodeInsert(node->u.child[i], at, row);
+  node->count++;
+  if (split == NULL)
+    return NULL;
+  return rowNodeAdopt(node, i, split);
+}
+
+
+rownode *rowLeafCut(rownode *leaf, int at) { // fold lines at onwards into a new sibling
+  char *p = rowFoldLine(leaf, at);
+  rownode *sib = rowNodeNew(1);
+  sib->fold = p;
+  sib->foldlen = leaf->fold + leaf->foldlen - p;
+  sib->count = leaf->count - at;
+  leaf->foldlen = p - leaf->fold;
+  leaf->count = at;
+
+  sib->next = leaf->next;
+  sib->prev = leaf;
+  if (leaf->next)
+    leaf->next->prev = sib;
+  leaf->next = sib;
+  return sib;
+}
+
+
+rownode *rowLeafUnfold(rownode *leaf, int at) { // one step toward making row at, may split off a sibling
+  // a leaf is made half full, so typing new lines into it does not split
+  // it straight away; lines before the made ones are cut off first
+  int first = at - at % (ROWTREE_FANOUT / 2);
+  if (first > 0)
+    return rowLeafCut(leaf, first);
+
+  int k = leaf->count < ROWTREE_FANOUT / 2 ? leaf->count : ROWTREE_FANOUT / 2;
+  rownode *sib = k < leaf->count ? rowLeafCut(leaf, k) : NULL;
+  char *p = leaf->fold;
+  char *end = leaf->fold + leaf->foldlen;
+  for (int j = 0; j < k; j++)
+    p = rowMapLine(&leaf->u.row[j], p, end);
+  leaf->fold = NULL;
+  leaf->foldlen = 0;
+  leaf->n = k;
+  E.unfolded += k;
+  return sib;
+}
+
+
+rownode *rowNodeUnfold(rownode *node, int at) { // returns new sibling on split
+  if (node->leaf)
+    return rowLeafUnfold(node, at);
+
+  int i = rowNodeChild(node, &at);
+  rownode *split = rowNodeUnfold(node->u.child[i], at);
+  if (split == NULL)
+    return NULL;
+  return rowNodeAdopt(node, i, split);
+}
+
+
+void rowTreeGrow(rownode *sib) { // the root split, add a level above it
+  rownode *root = rowNodeNew(0);
+  root->n = 2;
+  root->u.child[0] = E.rows;
+  root->u.child[1] = sib;
+  root->count = E.rows->count + sib->count;
+  E.rows = root;
+}
+
+
+void rowTreeUnfold(int at) { // make the rows of the folded leaf holding row at
+  pthread_rwlock_wrlock(&E.rowlock);
+  int i = at;
+  while (rowTreeLeaf(&i)->fold) {
+    rownode *sib = rowNodeUnfold(E.rows, at);
+    if (sib)
+      rowTreeGrow(sib);
+    i = at;
+  }
+  pthread_rwlock_unlock(&E.rowlock);
+}
+
+
+erow *editorRowAt(int at) { // O(log n) lookup by line number
+  if (at < 0 || at >= E.numrows)
+    return NULL;
+
+  int i = at;
+  rownode *leaf = rowTreeLeaf(&i);
+  if (leaf->fold) {
+    rowTreeUnfold(at);
+    leaf = rowTreeLeaf(&at);
+    i = at;
+  }
+  return &leaf->u.row[i];
+}
+
+
+void rowNodeMerge(rownode *node, int i) { // rebalances children i and i + 1
+  rownode *a = node->u.child[i];
+  rownode *b = node->u.child[i + 1];
+  int total = a->n + b->n;
+
+  if (a->leaf && (a->fold || b->fold)) { // a fold only joins its neighbour in the file or an empty leaf
+    if (a->count == 0) {
+      a->fold = b->fold;
+      a->foldlen = b->foldlen;
+    }
+    else if (a->fold && b->fold && a->fold + a->foldlen == b->fold)
+      a->foldlen += b->foldlen;
+    else if (b->count > 0)
+      return;
+  }
+
+  if (total <= ROWTREE_FANOUT) { // everything fits in a
+    if (a->leaf) {
+      memcpy(&a->u.row[a->n], b->u.row, sizeof(erow) * b->n);
+      a->next = b->next;
+      if (b->next)
+        b->next->prev = a;
+    }
+    else {
+      memcpy(&a->u.child[a->n], b->u.child, sizeof(rownode *) * b->n);
+    }
+    a->n = total;
+    a->count += b->count;
+    free(b);
+    memmove(&node->u.child[i + 1], &node->u.child[i + 2], sizeof(rownode *) * (node->n - i - 2));
+    node->n--;
+    return;
+  }
+
+  int want = total / 2; // otherwise even the two out
+  if (a->n < want) { // shift the front of b onto a
+    int k = want - a->n;
+    int moved = k;
+    if (a->leaf) {
+      memcpy(&a->u.row[a->n], b->u.row, sizeof(erow) * k);
+      memmove(b->u.row, &b->u.row[k], sizeof(erow) * (b->n - k));
+    }
+    else {
+      moved = 0;
+      for (int j = 0; j < k; j++)
+        moved += b->u.child[j]->count;
+      memcpy(&a->u.child[a->n], b->u.child, sizeof(rownode *) * k);
+      memmove(b->u.child, &b->u.child[k], sizeof(rownode *) * (b->n - k));
+    }
+    a->n += k;
+    b->n -= k;
+    a->count += moved;
+    b->count -= moved;
+  }
+  else { // shift the back of a onto b
+    int k = a->n - want;
+    int moved = k;
+    if (a->leaf) {
+      memmove(&b->u.row[k], b->u.row, sizeof(erow) * b->n);
+      memcpy(b->u.row, &a->u.row[a->n - k], sizeof(erow) * k);
+    }
+    else {
+      moved = 0;
+      for (int j = a->n - k; j < a->n; j++)
+        moved += a->u.child[j]->count;
+      memmove(&b->u.child[k], b->u.child, sizeof(rownode *) * b->n);
+      memcpy(b->u.child, &a->u.child[a->n - k], sizeof(rownode *) * k);
+    }
+    a->n -= k;
+    b->n += k;
+    a->count -= moved;
+    b->count += moved;
+  }
+}
+
+
+void rowNodeDelete(rownode *node, int at) {
+  if (node->leaf) {
+    memmove(&node->u.row[at], &node->u.row[at + 1], sizeof(erow) * (node->n - at - 1));
+    node->n--;
+    node->count--;
+    return;
+  }
+
+  int i = rowNodeChild(node, &at);
+  rownode *child = node->u.child[i];
+  rowNodeDelete(child, at);
+  node->count--;
+
+  if (child->n < ROWTREE_FANOUT / 4 && node->n > 1) // keep nodes at least a quarter full
+    rowNodeMerge(node, i > 0 ? i - 1 : i);
+}
+
+
+erow *rowTreeInsert(int at, erow *row) { // stores a copy of row at line at
+  if (E.rows == NULL)
+    E.rows = rowNodeNew(1);
+  if (E.numrows > 0) // the leaf taking the row must not be folded
+    editorRowAt(at < E.numrows ? at : at - 1);
+
+  rownode *sib = rowNodeInsert(E.rows, at, row);
+  if (sib) // root split, grow the tree by a level
+    rowTreeGrow(sib);
+  E.numrows++;
+  return editorRowAt(at);
+}
+
+
+void rowTreeDelete(int at) { // drops line at, the caller frees its contents
+  editorRowAt(at); // unfold its leaf
+  rowNodeDelete(E.rows, at);
+  E.numrows--;
+
+  while (!E.rows->leaf && E.rows->n == 1) { // shrink the tree by a level
+    rownode *root = E.rows->u.child[0];
+    free(E.rows);
+    E.rows = root;
+  }
+}
+
+
+rownode *rowTreeBuild(rownode *first, int leaves) { // stacks inner nodes over a chain of leaves, returns the root
+  rownode **level = malloc(sizeof(rownode *) * leaves);
+  if (level == NULL)
+    die("malloc");
+  int n = 0;
+  for (rownode *leaf = first; leaf; leaf = leaf->next)
+    level[n++] = leaf;
+
+  while (n > 1) { // a level at a time, children shared out evenly between parents
+    int parents = (n + ROWTREE_FANOUT - 1) / ROWTREE_FANOUT;
+    int k = 0;
+    for (int i = 0; i < parents; i++) {
+      rownode *node = rowNodeNew(0);
+      node->n = (n - k) / (parents - i);
+      for (int j = 0; j < node->n; j++) {
+        node->u.child[j] = level[k + j];
+        node->count += level[k + j]->count;
+      }
+      k += node->n;
+      level[i] = node;
+    }
+    n = parents;
+  }
+
+  rownode *root = level[0];
+  free(level);
+  return root;
+}
+
+
+int rowLeafRefold(rownode *leaf) { // fold a leaf of untouched rows back into its stretch of the file
+  char *mapend = E.map + E.maplen;
+  char *end = NULL;
+  for (int j = 0; j < leaf->n; j++) {
+    erow *row = &leaf->u.row[j];
+    if (!row->mapped || (end && row->chars != end)) // edited, or lines around it were
+      return 0;
+    char *nl = memchr(row->chars + row->size, '\n', mapend - row->chars - row->size);
+    end = nl ? nl + 1 : mapend;
+  }
+  if (end == NULL)
+    return 0;
+
+  for (int j = 0; j < leaf->n; j++)
+    rowCacheDrop(&leaf->u.row[j]);
+  leaf->fold = leaf->u.row[0].chars;
+  leaf->foldlen = end - leaf->fold;
+  leaf->n = 0;
+  return 1;
+}
+
+
+int rowNodeRefold(rownode *node, int first, int lo, int hi) { // refold leaves outside [lo, hi), returns rows still made
+  int made = 0;
+  for (int i = 0; i < node->n; i++) {
+    rownode *child = node->u.child[i];
+    int count = child->count;
+    if (!child->leaf) {
+      made += rowNodeRefold(child, first, lo, hi);
+    }
+    else {
+      if (!child->fold && (first + count <= lo || first >= hi))
+        rowLeafRefold(child);
+      made += child->fold ? 0 : child->n;
+      if (child->fold && i > 0 && node->u.child[i - 1]->fold) {
+        int n = node->n;
+        rowNodeMerge(node, i - 1); // joins it to the fold before if that ends where it starts
+        if (node->n < n)
+          i--;
+      }
+    }
+    first += count;
+  }
+  return made;
+}
+
+
+void rowTreeRefold(int lo, int hi) { // keep rows made only for lines lo to hi
+  if (E.rows == NULL || E.rows->leaf)
+    return;
+  pthread_rwlock_wrlock(&E.rowlock);
+  E.unfolded = rowNodeRefold(E.rows, 0, lo, hi);
+  pthread_rwlock_unlock(&E.rowlock);
+}
+
+
+void rowNodeFreeInner(rownode *node) { // frees the inner nodes, leaves stay on their chain
+  if (node->leaf)
+    return;
+  for (int i = 0; i < node->n; i++)
+    rowNodeFreeInner(node->u.child[i]);
+  free(node);
+}
+
+
+void rowTreeCompact() { // slide rows down the leaf chain into full leaves and rebuild above them
+  if (E.rows == NULL)
+    return;
+  pthread_rwlock_wrlock(&E.rowlock);
+  rownode *leaf = E.rows;
+  while (!leaf->leaf)
+    leaf = leaf->u.child[0];
+  rowNodeFreeInner(E.rows);
+
+  rownode *first = NULL, *last = NULL; // the leaves kept, in order
+  int leaves = 0;
+  rownode *fill = NULL; // leaf being filled, never ahead of the one read
+  while (leaf) {
+    rownode *next = leaf->next;
+    rownode *keep = NULL;
+    if (leaf->fold) {
+      keep = leaf;
+      fill = NULL; // rows on either side of a fold are different stretches
+    }
+    else {
+      int n = leaf->n;
+      for (int j = 0; j < n; j++) {
+        if (fill == NULL || fill->n == ROWTREE_FANOUT) { // rows yet to be read sit at or after j
+          fill = keep = leaf;
+          fill->n = 0;
+        }
+        fill->u.row[fill->n++] = leaf->u.row[j];
+        fill->count = fill->n;
+      }
+      if (fill != leaf)
+        free(leaf);
+    }
+    if (keep) {
+      keep->prev = last;
+      keep->next = NULL;
+      if (last)
+        last->next = keep;
+      else
+        first = keep;
+      last = keep;
+      leaves++;
+    }
+    leaf = next;
+  }
+  E.rows = first ? rowTreeBuild(first, leaves) : NULL;
+  pthread_rwlock_unlock(&E.rowlock);
+}
+
+
+long long rowNodeBytes(rownode *node, int *blocks) { // heap bytes held by node and its chars
+  long long bytes = sizeof(rownode);
+  (*blocks)++;
+  if (!node->leaf) {
+    for (int i = 0; i < node->n; i++)
+      bytes += rowNodeBytes(node->u.child[i], blocks);
+    return bytes;
+  }
+  for (int j = 0; j < node->n; j++) {
+    erow *row = &node->u.row[j];
+    if (!row->mapped && row->chars) {
+      bytes += row->cap;
+      (*blocks)++;
+    }
+  }
+  return bytes;
+}
+
+/*** syntax highlighting ***/
+
+int hlGet(unsigned char *hl, int i) { // class of cell i, the low nibble is the even cell
+  return i & 1 ? hl[i >> 1] >> 4 : hl[i >> 1] & 0x0f;
+}
+
+
+void hlSet(unsigned char *hl, int i, int v) {
+  unsigned char *b = &hl[i >> 1];
+  *b = i & 1 ? (*b & 0x0f) | v << 4 : (*b & 0xf0) | v;
+}
+
+
+void hlFill(unsigned char *hl, int i, int v, int n) { // memset over packed cells
+  if (n > 0 && (i & 1)) {
+    hlSet(hl, i++, v);
+    n--;
+  }
+  memset(&hl[i >> 1], v | v << 4, n >> 1);
+  if (n & 1)
+    hlSet(hl, i + n - 1, v);
+}
+
+
+void hlMove(unsigned char *hl, int to, int from, int n) { // memmove over packed cells
+  if (to < from)
+    for (int k = 0; k < n; k++)
+      hlSet(hl, to + k, hlGet(hl, from + k));
+  else
+    for (int k = n - 1; k >= 0; k--)
+      hlSet(hl, to + k, hlGet(hl, from + k));
+}
+
+
+int is_separator(int c) {
+  static unsigned char table[256];
+  static int built = 0;
+  if (!built) { // classify every byte once instead of strchr per call
+    for (int j = 0; j < 256; j++)
+      table[j] = isspace(j) || j == '\0' || strchr(",.()+-/*=~%<>[];", j) != NULL;
+    built = 1;
+  }
+  return table[(unsigned char)c];
+}
+
+
+unsigned int editorKeywordHash(const char *s, int len) { // fnv-1a
+  unsigned int h = 2166136261u;
+  for (int j = 0; j < len; j++) {
+    h ^= (unsigned char)s[j];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+void editorSyntaxCompile(struct editorSyntax *s) { // hash the keyword list, '|' marks KEYWORD2
+  if (s->kwtable)
+    return;
+
+  int n = 0;
+  while (s->keywords[n])
+    n++;
+
+  unsigned int size = 16;
+  while (size < (unsigned int)n * 2) // keep the table at most half full
+    size *= 2;
+  s->kwtable = calloc(size, sizeof(editorKeyword));
+  if (s->kwtable == NULL)
+    die("calloc");
+  s->kwmask = size - 1;
+
+  for (int j = 0; j < n; j++) {
+    char *word = s->keywords[j];
+    int len = strlen(word);
+    unsigned char hl = HL_KEYWORD1;
+    if (len > 0 && word[len - 1] == '|') {
+      len--;
+      hl = HL_KEYWORD2;
+    }
+
+    unsigned int h = editorKeywordHash(word, len) & s->kwmask;
+    while (s->kwtable[h].word && (s->kwtable[h].len != len ||
+          strncmp(s->kwtable[h].word, word, len)))
+      h = (h + 1) & s->kwmask;
+    if (s->kwtable[h].word == NULL) { // first spelling wins like the old linear scan
+      s->kwtable[h].word = word;
+      s->kwtable[h].len = len;
+      s->kwtable[h].hl = hl;
+    }
+  }
+}
+
+
+int editorKeywordLookup(struct editorSyntax *s, const char *tok, int len) { // hl class or 0
+  unsigned int h = editorKeywordHash(tok, len) & s->kwmask;
+  while (s->kwtable[h].word) {
+    if (s->kwtable[h].len == len && !memcmp(s->kwtable[h].word, tok, len))
+      return s->kwtable[h].hl;
+    h = (h + 1) & s->kwmask;
+  }
+  return 0;
+}
+
+int editorLexEndState(char *chars, int size, int in_comment) { // comment state after a line, touches nothing
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  // only strings and comments decide the state, and tabs expanding to
+  // spaces cannot change either, so this can run over chars directly
+  int state = in_comment;
+  int in_string = 0;
+  int i = 0;
+  while (i < size) {
+    char *p = &chars[i];
+    int left = size - i;
+
+    // the first byte is compared before strncmp, as most bytes start nothing
+    if (scs_len && !in_string && !state && *p == scs[0] && left >= scs_len && !strncmp(p, scs, scs_len))
+      break;
+
+    if (mcs_len && mce_len && !in_string) {
+      if (state) {
+        if (*p == mce[0] && left >= mce_len && !strncmp(p, mce, mce_len)) {
+          i += mce_len;
+          state = 0;
+        }
+        else {
+          i++;
+        }
+        continue;
+      }
+      else if (*p == mcs[0] && left >= mcs_len && !strncmp(p, mcs, mcs_len)) {
+        i += mcs_len;
+        state = 1;
+        continue;
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        if (*p == '\\' && i + 1 < size)
+          i++;
+        else if (*p == in_string)
+          in_string = 0;
+      }
+      else if (*p == '"' || *p == '\'') {
+        in_string = *p;
+      }
+    }
+    i++;
+  }
+  return state;
+}
+
+
+int editorRowEndState(erow *row, int in_comment) { // comment state after a row, without lexing hl
+  if (row->hl_valid && row->hl_start == in_comment)
+    return row->hl_open_comment;
+
+  row->hl_start = in_comment;
+  row->hl_open_comment = editorLexEndState(row->chars, row->size, in_comment);
+  row->hl_valid = 1; // any hl array left was lexed from another state
+  return row->hl_open_comment;
+}
+
+
+void editorSyntaxInvalidate(int filerow) { // filerow changed, rows below may start in a new state
+  int keep = filerow / KILO_HL_CHECKPOINT + 1;
+  if (E.hl_checkvalid > keep)
+    E.hl_checkvalid = keep;
+}
+
+
+void editorSyntaxReserve(int need) { // room for need checkpoints
+  if (need <= E.hl_checkcap)
+    return;
+  int cap = E.hl_checkcap ? E.hl_checkcap : 64;
+  while (need > cap)
+    cap *= 2;
+  unsigned char *check = realloc(E.hl_check, cap);
+  if (check == NULL)
+    die("realloc");
+  E.hl_check = check;
+  E.hl_checkcap = cap;
+}
+
+
+void *editorSyntaxWorker(void *arg) { // lex a chunk from both start states, rows are only read
+  hlchunk *c = arg;
+  int filerow = c->from * KILO_HL_CHECKPOINT;
+  int end = c->to * KILO_HL_CHECKPOINT;
+  int out = 0; // started outside a comment
+  int in = 1;  // started inside one
+  rowiter it = rowIterAt(filerow);
+  while (filerow < end) {
+    erow *row = rowIterNext(&it);
+    if (out == in) { // the two guesses met and stay together from here on
+      out = editorLexEndState(row->chars, row->size, out);
+      in = out;
+    }
+    else {
+      out = editorLexEndState(row->chars, row->size, out);
+      in = editorLexEndState(row->chars, row->size, in);
+    }
+    filerow++;
+
+    if (filerow % KILO_HL_CHECKPOINT == 0) {
+      int k = filerow / KILO_HL_CHECKPOINT - c->from - 1;
+      c->states[0][k] = out;
+      c->states[1][k] = in;
+    }
+  }
+  return NULL;
+}
+
+
+void editorSyntaxSettle(int upto, int nchunks) { // fill checkpoints up to upto, lexing on nchunks threads
+  // a chunk cannot know whether it starts inside a comment until the one
+  // before it is done, so each is lexed for both; picking the right
+  // states afterwards is one pass over the checkpoints
+  int from = E.hl_checkvalid - 1;
+  if (nchunks > upto - from)
+    nchunks = upto - from;
+  editorSyntaxReserve(upto + 1);
+
+  hlchunk chunks[KILO_HL_THREADS];
+  unsigned char *states = malloc(2 * (upto - from));
+  if (states == NULL)
+    die("malloc");
+  int k = from;
+  for (int i = 0; i < nchunks; i++) {
+    chunks[i].from = k;
+    chunks[i].to = k + (upto - k) / (nchunks - i);
+    chunks[i].states[0] = states + 2 * (k - from);
+    chunks[i].states[1] = chunks[i].states[0] + (chunks[i].to - k);
+    k = chunks[i].to;
+  }
+
+  editorRunChunks(editorSyntaxWorker, chunks, sizeof(hlchunk), nchunks);
+
+  int state = E.hl_check[from];
+  for (int i = 0; i < nchunks; i++) {
+    int n = chunks[i].to - chunks[i].from;
+    memcpy(&E.hl_check[chunks[i].from + 1], chunks[i].states[state], n);
+    state = chunks[i].states[state][n - 1];
+  }
+  E.hl_checkvalid = upto + 1;
+  free(states);
+}
+
+
+int editorRowStartState(int at) { // does row at start inside a multi-line comment
+  if (E.syntax == NULL || at <= 0)
+    return 0;
+
+  if (E.hl_checkvalid == 0) { // the first row always starts clean
+    editorSyntaxReserve(1);
+    E.hl_check[0] = 0;
+    E.hl_checkvalid = 1;
+  }
+
+  int k = at / KILO_HL_CHECKPOINT;
+  if (k >= E.hl_checkvalid)
+    k = E.hl_checkvalid - 1;
+
+  // a long way from the last checkpoint is walked on every core at once,
+  // each taking the frame's budget
+  if (E.hl_cores == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    E.hl_cores = n < 1 ? 1 : n > KILO_HL_THREADS ? KILO_HL_THREADS : n;
+  }
+  int cores = E.hl_cores;
+  int want = at / KILO_HL_CHECKPOINT;
+  if (cores > 1 && want - k >= cores && E.hl_budget > 0) {
+    int upto = k + (int)((long long)E.hl_budget * cores / KILO_HL_CHECKPOINT);
+    if (upto > want)
+      upto = want;
+    if (upto > k) {
+      editorSyntaxSettle(upto, cores);
+      E.hl_budget -= (upto - k) * KILO_HL_CHECKPOINT / cores;
+      k = upto;
+    }
+  }
+
+  int filerow = k * KILO_HL_CHECKPOINT; // walk forward from the nearest checkpoint
+  int state = E.hl_check[k];
+  rowiter it = rowIterAt(filerow);
+  while (filerow < at) {
+    if (E.hl_budget <= 0) { // out of time for this frame, guess and finish when idle
+      if (at > E.hl_wanted)
+        E.hl_wanted = at;
+      erow *row = editorRowAt(at);
+      return row->hl_valid ? row->hl_start : state;
+    }
+    E.hl_budget--;
+
+    state = editorRowEndState(rowIterNext(&it), state);
+    filerow++;
+
+    if (filerow % KILO_HL_CHECKPOINT == 0 && filerow / KILO_HL_CHECKPOINT == E.hl_checkvalid) {
+      editorSyntaxReserve(E.hl_checkvalid + 1);
+      E.hl_check[E.hl_checkvalid++] = state;
+    }
+  }
+  return state;
+}
+
+
+int editorSyntaxIdle() { // settle one slice of guessed rows, 1 once they can be redrawn
+  if (E.hl_wanted < 0)
+    return 0;
+
+  int wanted = E.hl_wanted;
+  if (wanted >= E.numrows)
+    wanted = E.numrows - 1;
+
+  E.hl_wanted = -1;
+  E.hl_budget = KILO_HL_BUDGET;
+  editorRowStartState(wanted); // leaves checkpoints behind even if it runs out
+  return E.hl_wanted < 0;
+}
+
+
+void editorUpdateSyntax(int filerow, int from, int conv, int edited) { // re-lex from the token before from
+  erow *row = editorRowAt(filerow);
+  rcentry *e = rowCacheGet(row);
+  char *render = rowCacheRender(row, e);
+  unsigned char *hl = rowCacheHl(e);
+  int rsize = e->rsize;
+  if (E.syntax == NULL) {
+    if (row->hl_valid != 2)
+      from = 0;
+    hlFill(hl, from, HL_NORMAL, rsize - from);
+    row->hl_valid = 2;
+    return;
+  }
+
+  int start = editorRowStartState(filerow);
+  if (row->hl_valid != 2 || row->hl_start != start) { // hl was lexed from another state
+    from = 0;
+    conv = rsize;
+  }
+
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  // hl before from is still valid, back up to whitespace the lexer saw
+  // outside any string or comment, where its state is known to be clean
+  int i = from;
+  while (i > 0 && !(isspace((unsigned char)render[i - 1]) && hlGet(hl, i - 1) == HL_NORMAL))
+    i--;
+
+  int in_comment = (i == 0) ? start : 0;
+
+  int prev_sep = 1;
+  int in_string = 0;
+
+  while (i < rsize) {
+    char c = render[i];
+    unsigned char prev_hl = (i > 0) ? hlGet(hl, i - 1) : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment) {
+      if (rsize - i >= scs_len && !strncmp(&render[i], scs, scs_len)) {
+        hlFill(hl, i, HL_COMMENT, rsize - i);
+        break;
+      }
+    }
+
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        hlSet(hl, i, HL_MLCOMMENT);
+        if (rsize - i >= mce_len && !strncmp(&render[i], mce, mce_len)) {
+          hlFill(hl, i, HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          continue;
+        }
+        else {
+          i++;
+          continue;
+        }
+      }
+      else if (rsize - i >= mcs_len && !strncmp(&render[i], mcs, mcs_len)) {
+        hlFill(hl, i, HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        hlSet(hl, i, HL_STRING);
+        if (c == '\\' && i + 1 < rsize) {
+          hlSet(hl, i + 1, HL_STRING);
+          i += 2;
+          continue;
+        }
+        if (c == in_string)
+          in_string = 0;
+        i++;
+        prev_sep = 1;
+        continue;
+      }
+      else {
+        if (c == '"' || c == '\'') {
+          in_string = c;
+          hlSet(hl, i, HL_STRING);
+          i++;
+          continue;
+        }
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+          (c == '.' && prev_hl == HL_NUMBER)) {
+        hlSet(hl, i, HL_NUMBER);
+        i++;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    if (prev_sep) { // a keyword is a whole token, measure it and hash it once
+      int klen = 0;
+      while (i + klen < rsize && !is_separator(render[i + klen]))
+        klen++;
+
+      int kw = klen ? editorKeywordLookup(E.syntax, &render[i], klen) : 0;
+      if (kw) {
+        hlFill(hl, i, kw, klen);
+        i += klen;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    // past conv the old hl is lined up with the new render; once both
+    // lexes agree on clean whitespace the rest of the row cannot differ
+    if (i >= conv && isspace((unsigned char)c) && hlGet(hl, i) == HL_NORMAL) {
+      row->hl_valid = 2;
+      return;
+    }
+
+    hlSet(hl, i, HL_NORMAL);
+    prev_sep = is_separator(c);
+    i++;
+  }
+
+  // rows below notice a new start state when they are next drawn, only the
+  // checkpoints that were walked through this row need to go; the parallel
+  // settle fills checkpoints without recording what each row ends in, so an
+  // edit to a row whose old end state is unknown may have moved them too
+  int known = row->hl_valid && row->hl_start == start;
+  if (known ? row->hl_open_comment != in_comment : edited)
+    editorSyntaxInvalidate(filerow);
+
+  row->hl_start = start;
+  row->hl_open_comment = in_comment;
+  row->hl_valid = 2;
+}
+
+int editorSyntaxToColor(int hl) {
+  switch(hl) {
+    case HL_NUMBER: return 31;
+    case HL_KEYWORD2: return 32;
+    case HL_KEYWORD1: return 33;
+    case HL_MATCH: return 34;
+    case HL_STRING: return 35;
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
+    default: return 37;
+  }
+}
+
+void editorSyntaxReset() { // forget all lexer state, rows are re-lexed when drawn
+  E.hl_checkvalid = 0;
+
+  rowiter it = rowIterAt(0);
+  rownode *leaf;
+  while ((leaf = rowIterLeaf(&it)) != NULL) {
+    if (leaf->fold) { // nothing lexed in there
+      it.leaf = leaf->next;
+      it.i = 0;
+      continue;
+    }
+    rowIterNext(&it)->hl_valid = 0;
+  }
+}
+
+
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+  editorSyntaxReset();
+  if (E.filename == NULL || E.huge) // lexing a folded file would unfold all of it
+    return;
+
+  char *ext = strrchr(E.filename, '.');
+
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        E.syntax = s;
+        editorSyntaxCompile(s);
+        editorSyntaxReset();
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*** row operations ***/
+
+int editorRowCxToRx(erow *row, int cx) { // adjusts cx for tabs -> rx
+  int rx = 0;
+  int j;
+  for (j = 0; j < cx; j++) {
+    if (row->chars[j] == '\t')
+      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+
+int editorRowRxToCx(erow *row, int rx) {
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) { // loop through acccumulating cur_rx for conversion
+    if (row->chars[cx] == '\t')
+      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+    cur_rx++;
+    if (cur_rx > rx)
+      return cx;
+  }
+  return cx; // if out of range
+}
+
+
+void editorRowRender(int filerow, int from, int to, int edited) { // render chars [from, to) again, edited if they changed
+  erow *row = editorRowAt(filerow);
+  rcentry *e = rowCacheGet(row);
+  if (e == NULL) { // nothing to reuse, not shown lately
+    from = 0;
+    to = row->size;
+  }
+
+  int tabs = 0;
+  int j;
+  for (j = from; j < row->size; j++)
+    if (row->chars[j] == '\t')
+      tabs++;
+
+  // a row without tabs renders to its own chars, only its hl is cached
+  int alias = tabs == 0 && (from == 0 || e->alias || !memchr(row->chars, '\t', from));
+  if (e && e->alias != alias) { // the first tab came or the last went, render it all
+    from = 0;
+    to = row->size;
+  }
+
+  int rx = editorRowCxToRx(row, from); // render before from is unchanged
+  int old_rsize = e ? e->rsize : 0;
+  int need = rx + (row->size - from) + tabs*(KILO_TAB_STOP - 1) + 1;
+  e = rowCacheReserve(row, need, alias);
+  char *render = e->block;
+
+  // chars from to onwards are the old tail; after the first tab past the
+  // edit (or right at to if there is none) they sit a fixed distance from
+  // where they used to be rendered
+  int idx = rx;
+  int conv = -1;
+  int tabseen = 0; // a tab past the edit has set conv for good
+  if (alias) {
+    idx = row->size;
+    conv = to;
+  }
+  for (j = from; j < row->size && !alias; j++) { // inster 8 spaces for tabs
+    if (j == to && conv == -1)
+      conv = idx;
+    if (row->chars[j] == '\t') {
+      render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0)
+        render[idx++] = ' ';
+      if (j >= to && !tabseen) {
+        conv = idx;
+        tabseen = 1;
+      }
+    }
+    else {
+      render[idx++] = row->chars[j];
+    }
+  }
+  if (conv == -1)
+    conv = idx;
+  e->rsize = idx;
+
+  int delta = e->rsize - old_rsize; // slide the old hl tail under its chars
+  if (conv < e->rsize)
+    hlMove(rowCacheHl(e), conv, conv - delta, e->rsize - conv);
+
+  editorUpdateSyntax(filerow, rx, conv, edited);
+}
+
+
+void editorUpdateRowSpan(int filerow, int from, int to) { // chars [from, to) changed
+  editorRowRender(filerow, from, to, 1);
+}
+
+
+void editorUpdateRow(int filerow) { // handles rendering special characters like tab
+  editorUpdateRowSpan(filerow, 0, editorRowAt(filerow)->size);
+}
+
+
+void editorRowMaterialize(int at) { // bring render/hl up to date for a row about to be shown
+  if (at < 0 || at >= E.numrows)
+    return;
+
+  erow *row = editorRowAt(at);
+  rcentry *e = rowCacheGet(row);
+  if (e == NULL) {
+    editorRowRender(at, 0, row->size, 0);
+    return;
+  }
+  rowCacheTouch(e);
+  if (row->hl_valid != 2 || (E.syntax && row->hl_start != editorRowStartState(at)))
+    editorUpdateSyntax(at, 0, e->rsize, 0);
+}
+
+
+erow *editorInsertRowSlot(int at) { // opens an empty row at index at
+  erow row;
+  row.size = 0;
+  row.cap = 0;
+  row.mapped = 0;
+  row.chars = NULL;
+  row.rslot = 0;
+  row.rtag = 0;
+  row.hl_open_comment = 0;
+  row.hl_start = 0;
+  row.hl_valid = 0;
+  row.savegen = 0;
+  editorSyntaxInvalidate(at);
+  return rowTreeInsert(at, &row);
+}
+
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) // verify the value of at is valid
+    return;
+
+  erow *row = editorInsertRowSlot(at);
+  row->size = len;
+  row->cap = len + 1;
+  row->chars = malloc(row->cap);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  editorUpdateRow(at); // update render rsize
+
+  E.dirty++;
+}
+
+
+int editorRowShared(erow *row) { // 1 if a running save is still reading row's chars
+  return E.save.running && !row->mapped && row->savegen == E.save.gen;
+}
+
+
+void editorSaveRetire(char *chars) { // free chars once the running save is done with them
+  if (E.save.nretired == E.save.retiredcap) {
+    int cap = E.save.retiredcap ? E.save.retiredcap * 2 : 64;
+    char **retired = realloc(E.save.retired, sizeof(char *) * cap);
+    if (retired == NULL)
+      die("realloc");
+    E.save.retired = retired;
+    E.save.retiredcap = cap;
+  }
+  E.save.retired[E.save.nretired++] = chars;
+}
+
+
+void editorRowReserve(erow *row, int need) { // make chars writable with room for need bytes
+  int shared = editorRowShared(row);
+  if (need <= row->cap && !row->mapped && !shared)
+    return;
+
+  int cap = need > row->cap * 2 ? need : row->cap * 2; // doubling keeps typing amortized O(1)
+  if (row->mapped || shared) { // the first edit copies the row out of the mapping or a save
+    if (cap < row->size + 1) // callers about to truncate may ask for less than the row holds
+      cap = row->size + 1;
+    char *chars = malloc(cap);
+    if (chars == NULL)
+      die("malloc");
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if (shared)
+      editorSaveRetire(row->chars);
+    row->chars = chars;
+    row->mapped = 0;
+    row->savegen = 0;
+  }
+  else {
+    char *chars = realloc(row->chars, cap);
+    if (chars == NULL)
+      die("realloc");
+    row->chars = chars;
+  }
+  row->cap = cap;
+}
+
+
+void editorFreeRow(erow *row) { // free row space/delete row
+  rowCacheDrop(row);
+  if (editorRowShared(row))
+    editorSaveRetire(row->chars);
+  else if (!row->mapped)
+    free(row->chars);
+}
+
+
+void editorRowTrim(erow *row) { // give back room chars grew past their contents
+  if (!row->mapped && row->chars && row->cap > row->size + 1 && !editorRowShared(row)) {
+    char *chars = realloc(row->chars, row->size + 1);
+    if (chars == NULL) // only shrinking, the row keeps the room it has
+      return;
+    row->chars = chars;
+    row->cap = row->size + 1;
+  }
+}
+
+
+void editorCompact() { // ^g: trim every row, refill the leaves and report what a line costs
+  if (E.numrows == 0) {
+    editorSetStatusMessage("No lines to compact");
+    return;
+  }
+  int blocks = 0;
+  double before = rowNodeBytes(E.rows, &blocks) / (double)E.numrows;
+
+  rowiter it = rowIterAt(0);
+  for (rownode *leaf = it.leaf; leaf; leaf = leaf->next)
+    for (int j = 0; j < leaf->n; j++)
+      editorRowTrim(&leaf->u.row[j]);
+  rowTreeCompact();
+
+  blocks = 0;
+  double after = rowNodeBytes(E.rows, &blocks) / (double)E.numrows;
+  editorSetStatusMessage("%d lines, %.1f B a line (was %.1f), %d blocks, %lld KB shown",
+      E.numrows, after, before, blocks, E.rcache.bytes >> 10);
+}
+
+
+void editorDelRow(int at) { // del at row begining
+  if (at < 0 || at >= E.numrows)
+    return;
+  editorFreeRow(editorRowAt(at));
+  rowTreeDelete(at); // rows below move up 1
+  editorSyntaxInvalidate(at);
+  E.dirty++;
+}
+
+
+void editorRowInsertChar(int filerow, int at, int c) {
+  erow *row = editorRowAt(filerow);
+  if (at < 0 || at > row->size) 
+    at = row->size;
+  
+  editorRowReserve(row, row->size + 2);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // makes room for char at index at
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRowSpan(filerow, at, at + 1);
+  E.dirty++;
+}
+
+
+void editorRowAppendString(int filerow, char *s, size_t len) {
+  erow *row = editorRowAt(filerow);
+  editorRowReserve(row, row->size + len + 1); // new row including null
+  memcpy(&row->chars[row->size], s, len); // copy the string
+  row->size += len; // new len
+  row->chars[row->size] = '\0'; // terminate row with null
+  editorUpdateRowSpan(filerow, row->size - len, row->size);
+  E.dirty++;
+}
+
+
+void editorRowDelChar(int filerow, int at) {
+  erow *row = editorRowAt(filerow);
+  if (at < 0 || at >= row->size)
+    return;
+  editorRowReserve(row, row->size + 1);
+  memmove(&row->chars[at], &row->chars[at + 1], row->size - at); // move row left one with null at the end
+  row->size--;
+  editorUpdateRowSpan(filerow, at, at);
+  E.dirty++;
+}
+
+/** editor operations ***/
+
+void editorInsertChar(int c) {
+  int y = E.cy, x = E.cx;
+  int append = E.cy == E.numrows;
+  if (append) { // cursor rests on tilde
+    editorInsertRow(E.numrows, "", 0); // add a row
+  }
+
+  editorRowInsertChar(E.cy, E.cx, c);
+  E.cx++;
+
+  char ch = c;
+  editorUndoInsert(y, x, append, &ch, 1);
+}
+
+
+void editorInsertNewline() {
+  int y = E.cy, x = E.cx;
+  int append = E.cy == E.numrows; // on the tilde only a row is added, no line break
+
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0); // if there is nothing in current row
+  }
+  else {
+    erow *row = editorRowAt(E.cy);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx); // write current row
+    row = editorRowAt(E.cy);
+    editorRowReserve(row, row->size + 1);
+    row->size = E.cx;
+    row->chars[row->size] = '\0'; // terminate new row
+    editorUpdateRowSpan(E.cy, E.cx, E.cx); // add new row or other half of exising row
+  }
+  E.cy++;
+  E.cx = 0;
+
+  editorUndoInsert(y, x, append, "\n", append ? 0 : 1);
+}
+
+
+void editorInsertText(char *s, int len) { // put \n separated lines at the cursor as one batch
+  if (E.cy == E.numrows) // cursor rests on tilde
+    editorInsertRow(E.numrows, "", 0);
+
+  char *nl = memchr(s, '\n', len);
+  int first = nl ? nl - s : len;
+
+  erow *row = editorRowAt(E.cy);
+  if (first == len) { // a single line goes into the current row
+    editorRowReserve(row, row->size + len + 1);
+    memmove(&row->chars[E.cx + len], &row->chars[E.cx], row->size - E.cx + 1);
+    memcpy(&row->chars[E.cx], s, len);
+    row->size += len;
+    editorUpdateRowSpan(E.cy, E.cx, E.cx + len);
+    E.cx += len;
+    E.dirty++;
+    return;
+  }
+
+  // the first line ends the current row and what followed the cursor ends
+  // the last one; rows in between are inserted unrendered, so only those
+  // that get shown are ever rendered and lexed
+  int taillen = row->size - E.cx;
+  char *tail = malloc(taillen ? taillen : 1);
+  if (tail == NULL)
+    die("malloc");
+  memcpy(tail, &row->chars[E.cx], taillen);
+  editorRowReserve(row, E.cx + first + 1);
+  memcpy(&row->chars[E.cx], s, first);
+  row->size = E.cx + first;
+  row->chars[row->size] = '\0';
+  editorUpdateRowSpan(E.cy, E.cx, row->size);
+
+  char *p = nl;
+  while (p < s + len) {
+    p++;
+    char *end = memchr(p, '\n', s + len - p);
+    if (end == NULL)
+      end = s + len;
+    int linelen = end - p;
+    int last = end == s + len;
+
+    E.cy++;
+    erow *line = editorInsertRowSlot(E.cy);
+    line->size = linelen + (last ? taillen : 0);
+    line->cap = line->size + 1;
+    line->chars = malloc(line->cap);
+    if (line->chars == NULL)
+      die("malloc");
+    memcpy(line->chars, p, linelen);
+    if (last)
+      memcpy(&line->chars[linelen], tail, taillen);
+    line->chars[line->size] = '\0';
+    E.cx = linelen;
+    p = end;
+  }
+  free(tail);
+  E.dirty++;
+}
+
+
+void editorPaste() { // read a bracketed paste up to its end marker and insert it
+  static const char end[] = "\x1b[201~";
+  int endlen = sizeof(end) - 1;
+  int cap = 4096;
+  int len = 0;
+  char *buf = malloc(cap);
+  if (buf == NULL)
+    die("malloc");
+
+  int c;
+  while ((c = editorInputByte(KILO_PASTE_TIMEOUT)) != -1) {
+    if (len == cap) {
+      char *grown = realloc(buf, cap * 2);
+      if (grown == NULL)
+        die("realloc");
+      buf = grown;
+      cap *= 2;
+    }
+    buf[len++] = c;
+    if (len >= endlen && c == '~' && !memcmp(&buf[len - endlen], end, endlen)) {
+      len -= endlen;
+      break;
+    }
+  }
+
+  int out = 0; // terminals send \r for a line break, some apps \r\n
+  for (int i = 0; i < len; i++) {
+    if (buf[i] == '\r' && i + 1 < len && buf[i + 1] == '\n')
+      continue;
+    buf[out++] = buf[i] == '\r' ? '\n' : buf[i];
+  }
+  len = out;
+
+  if (len) {
+    int y = E.cy, x = E.cx;
+    int append = E.cy == E.numrows;
+    editorInsertText(buf, len);
+    editorUndoInsert(y, x, append, buf, len);
+  }
+  free(buf);
+}
+
+
+void editorDelChar() {
+  if (E.cy == E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0) // cant delete first line
+    return;
+
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0) {
+    editorUndoDelete(E.cy, E.cx - 1, E.cy, E.cx, &row->chars[E.cx - 1], 1);
+    editorRowDelChar(E.cy, E.cx - 1);
+    E.cx--; // decriment for deleted char
+  }
+  else {
+    editorUndoDelete(E.cy - 1, editorRowAt(E.cy - 1)->size, E.cy, 0, "\n", 1);
+    E.cx = editorRowAt(E.cy - 1)->size;
+    editorRowAppendString(E.cy - 1, row->chars, row->size); // appends row up 1
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+/*** undo ***/
+
+#define UNDO_SIZE(len) (((sizeof(undoop) + (len) + sizeof(int) - 1) / sizeof(int) + 1) * sizeof(int))
+
+char *undoText(undoop *op) {
+  return (char *)(op + 1);
+}
+
+
+undoop *editorUndoBefore(size_t end) { // record that ends at offset end of the arena
+  int size;
+  memcpy(&size, &E.undo.arena[end - sizeof(int)], sizeof(int)); // each record ends with its size
+  return (undoop *)&E.undo.arena[end - size];
+}
+
+
+undoop *editorUndoAlloc(size_t at, int len) { // (re)place the last record at offset at with room for len bytes of text
+  size_t size = UNDO_SIZE(len);
+  if (at + size > E.undo.cap) {
+    E.undo.cap = at + size > E.undo.cap * 2 ? at + size : E.undo.cap * 2;
+    E.undo.arena = realloc(E.undo.arena, E.undo.cap);
+    if (E.undo.arena == NULL)
+      die("realloc");
+  }
+  int isize = size;
+  memcpy(&E.undo.arena[at + size - sizeof(int)], &isize, sizeof(int));
+  E.undo.len = E.undo.cur = at + size;
+
+  undoop *op = (undoop *)&E.undo.arena[at];
+  op->len = len;
+  return op;
+}
+
+
+void editorUndoTrim() { // drop the oldest records once history outgrows its budget
+  if (E.undo.len <= KILO_UNDO_BUDGET)
+    return;
+
+  // trimming well below the budget pays for the move once per quarter
+  // budget of new history; the newest record stays however big it is
+  size_t cut = 0;
+  while (E.undo.len - cut > KILO_UNDO_BUDGET / 4 * 3) {
+    size_t size = UNDO_SIZE(((undoop *)&E.undo.arena[cut])->len);
+    if (cut + size == E.undo.len)
+      break;
+    cut += size;
+  }
+  memmove(E.undo.arena, &E.undo.arena[cut], E.undo.len - cut);
+  E.undo.len -= cut;
+  E.undo.cur -= cut;
+}
+
+
+void editorUndoPush(int kind, int append, int y, int x, int y2, int x2,
+    int cy, int cx, char *s, int len) { // journal an edit, forgetting anything that could be redone
+  undoop *op = editorUndoAlloc(E.undo.cur, len);
+  op->kind = kind;
+  op->append = append;
+  op->y = y;
+  op->x = x;
+  op->y2 = y2;
+  op->x2 = x2;
+  op->cy = cy;
+  op->cx = cx;
+  memcpy(undoText(op), s, len);
+  E.undo.merge = len == 1 && s[0] != '\n'; // typing runs merge up to a line break
+  editorUndoTrim();
+}
+
+
+void editorUndoInsert(int y, int x, int append, char *s, int len) { // s now runs from (y, x) to the cursor
+  editorSwapLog(UNDO_INSERT, append, y, x, E.cy, E.cx, s, len);
+  if (E.undo.merge && !append && len == 1 && s[0] != '\n') {
+    undoop *op = editorUndoBefore(E.undo.cur);
+    if (op->kind == UNDO_INSERT && op->y2 == y && op->x2 == x) { // typed right after the last insert
+      size_t at = (char *)op - E.undo.arena;
+      op = editorUndoAlloc(at, op->len + 1);
+      undoText(op)[op->len - 1] = s[0];
+      op->y2 = E.cy;
+      op->x2 = E.cx;
+      return;
+    }
+  }
+  editorUndoPush(UNDO_INSERT, append, y, x, E.cy, E.cx, y, x, s, len);
+}
+
+
+void editorUndoDelete(int y, int x, int y2, int x2, char *s, int len) { // s from (y, x) to (y2, x2) is about to go
+  editorSwapLog(UNDO_DELETE, 0, y, x, y2, x2, s, len);
+  if (E.undo.merge && len == 1 && s[0] != '\n' && y == y2) {
+    undoop *op = editorUndoBefore(E.undo.cur);
+    if (op->kind == UNDO_DELETE && op->y == y && op->y2 == y && (x2 == op->x || x == op->x)) {
+      size_t at = (char *)op - E.undo.arena;
+      int back = x2 == op->x; // backspace grows the run leftwards, delete rightwards
+      op = editorUndoAlloc(at, op->len + 1);
+      char *text = undoText(op);
+      if (back) {
+        memmove(&text[1], text, op->len - 1);
+        text[0] = s[0];
+        op->x = x;
+      }
+      else {
+        text[op->len - 1] = s[0];
+        op->x2++;
+      }
+      return;
+    }
+  }
+  editorUndoPush(UNDO_DELETE, 0, y, x, y2, x2, E.cy, E.cx, s, len);
+}
+
+
+void editorDeleteText(int y, int x, int y2, int x2) { // take out the text from (y, x) to (y2, x2)
+  erow *row = editorRowAt(y);
+  erow *last = editorRowAt(y2);
+  int taillen = last->size - x2;
+  editorRowReserve(row, x + taillen + 1);
+  memmove(&row->chars[x], &last->chars[x2], taillen); // last may be row itself
+  row->size = x + taillen;
+  row->chars[row->size] = '\0';
+  editorUpdateRowSpan(y, x, y == y2 ? x : row->size);
+
+  for (int n = y2 - y; n > 0; n--) // rows below move up as each goes
+    editorDelRow(y + 1);
+  E.dirty++;
+}
+
+
+void editorUndoApply(undoop *op, int insert) { // put op's text back in, or take it out again
+  editorSwapLog(insert ? UNDO_INSERT : UNDO_DELETE, op->append, op->y, op->x, op->y2, op->x2,
+      undoText(op), op->len);
+  if (insert) {
+    E.cy = op->y;
+    E.cx = op->x;
+    editorInsertText(undoText(op), op->len);
+  }
+  else if (op->append) { // every row from y on was added by the edit
+    for (int n = op->y2 - op->y + 1; n > 0 && op->y < E.numrows; n--)
+      editorDelRow(op->y);
+  }
+  else {
+    editorDeleteText(op->y, op->x, op->y2, op->x2);
+  }
+}
+
+
+void editorUndo() {
+  if (E.undo.cur == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  undoop *op = editorUndoBefore(E.undo.cur);
+  editorUndoApply(op, op->kind == UNDO_DELETE);
+  E.undo.cur = (char *)op - E.undo.arena;
+  E.undo.merge = 0;
+  E.cy = op->cy;
+  E.cx = op->cx;
+}
+
+
+void editorRedo() {
+  if (E.undo.cur == E.undo.len) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  undoop *op = (undoop *)&E.undo.arena[E.undo.cur];
+  editorUndoApply(op, op->kind == UNDO_INSERT);
+  E.undo.cur += UNDO_SIZE(op->len);
+  E.undo.merge = 0;
+  E.cy = op->kind == UNDO_INSERT ? op->y2 : op->y;
+  E.cx = op->kind == UNDO_INSERT ? op->x2 : op->x;
+}
+
+/*** file i/o ***/
+
+void *editorLoadWorker(void *arg) { // index one chunk of the file into a chain of leaves
+  loadchunk *c = arg;
+  char *nls[ROWTREE_FANOUT];
+  char *p = c->p;
+  while (p < c->end) {
+    rownode *leaf = rowNodeNew(1);
+    if (c->huge) { // a fold only needs its line count
+      char *cut = c->end - p > KILO_HUGE_FOLD ? memchr(p + KILO_HUGE_FOLD, '\n', c->end - p - KILO_HUGE_FOLD) : NULL;
+      cut = cut ? cut + 1 : c->end;
+      leaf->fold = p;
+      leaf->foldlen = cut - p;
+      leaf->count = rowCountLines(p, cut);
+      p = cut;
+    }
+    else { // rows borrow their chars from the mapping, nothing is copied
+      int n = rowScanLines(p, c->end, nls, ROWTREE_FANOUT);
+      for (int j = 0; j < n; j++) {
+        rowMapSpan(&leaf->u.row[j], p, nls[j]);
+        p = nls[j] + 1;
+      }
+      if (n < ROWTREE_FANOUT && p < c->end) { // last line of the file has no newline
+        rowMapSpan(&leaf->u.row[n++], p, c->end);
+        p = c->end;
+      }
+      leaf->n = n;
+      leaf->count = n;
+    }
+
+    leaf->prev = c->last;
+    if (c->last)
+      c->last->next = leaf;
+    else
+      c->first = leaf;
+    c->last = leaf;
+    c->leaves++;
+    c->rows += leaf->count;
+  }
+  return NULL;
+}
+
+
+void editorLoad() { // build the row tree over the whole mapping
+  // the file is cut into chunks at line starts, each indexed on its own
+  // thread; their chains of leaves are then joined and a tree stacked on
+  // top in one go
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int nchunks = E.maplen / KILO_LOAD_CHUNK + 1;
+  if (nchunks > cores)
+    nchunks = cores;
+  if (nchunks > KILO_LOAD_THREADS)
+    nchunks = KILO_LOAD_THREADS;
+  if (nchunks < 1)
+    nchunks = 1;
+
+  loadchunk chunks[KILO_LOAD_THREADS];
+  char *p = E.map;
+  char *end = E.map + E.maplen;
+  for (int i = 0; i < nchunks; i++) {
+    char *cut = p + (end - p) / (nchunks - i);
+    char *nl = cut < end ? memchr(cut, '\n', end - cut) : NULL;
+    cut = nl ? nl + 1 : end;
+    memset(&chunks[i], 0, sizeof(loadchunk));
+    chunks[i].p = p;
+    chunks[i].end = cut;
+    chunks[i].huge = E.huge;
+    p = cut;
+  }
+
+  editorRunChunks(editorLoadWorker, chunks, sizeof(loadchunk), nchunks);
+
+  rownode *first = NULL;
+  rownode *last = NULL;
+  int leaves = 0;
+  for (int i = 0; i < nchunks; i++) {
+    loadchunk *c = &chunks[i];
+    if (c->first == NULL)
+      continue;
+    if (last) {
+      last->next = c->first;
+      c->first->prev = last;
+    }
+    else
+      first = c->first;
+    last = c->last;
+    leaves += c->leaves;
+    E.numrows += c->rows;
+  }
+  if (first)
+    E.rows = rowTreeBuild(first, leaves);
+}
+
+
+void editorOpen(char *filename) { // map the file and split it into rows in place
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+  
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    die("open");
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    die("fstat");
+
+  if (st.st_size > 0) {
+    E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (E.map == MAP_FAILED)
+      die("mmap");
+    E.maplen = st.st_size;
+  }
+  close(fd);
+
+  if (E.maplen > KILO_HUGE_BYTES) {
+    // the file is folded into leaves that point at stretches of the
+    // mapping; rows are only made where the view goes
+    E.huge = 1;
+    editorSelectSyntaxHighlight();
+    madvise(E.map, E.maplen, MADV_SEQUENTIAL);
+    editorLoad();
+    madvise(E.map, E.maplen, MADV_DONTNEED); // the pass needn't keep the file resident
+    madvise(E.map, E.maplen, MADV_NORMAL);
+  }
+  else if (E.maplen > 0) {
+    editorLoad();
+  }
+
+  E.dirty = 0;
+}
+
+
+int editorWriteAll(int fd, struct iovec *iov, int n) { // writev until every piece is out, -1 on error
+  while (n > 0) {
+    ssize_t written = writev(fd, iov, n);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) { // partial write, resume inside this piece
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+
+void editorSaveSpan(char *chars, size_t len, int newline, int fold) { // append to the snapshot, merging touching pieces
+  // mapped rows only touch what comes after them when they end in a plain
+  // \n, so checking a merged stretch for \r line ends changes none of them
+  savespan *last = E.save.nspans ? &E.save.spans[E.save.nspans - 1] : NULL;
+  if (last && !last->newline && last->chars + last->len == chars) {
+    last->len += len;
+    last->newline = newline;
+    last->fold |= fold;
+    return;
+  }
+  if (E.save.nspans == E.save.spancap) {
+    int cap = E.save.spancap ? E.save.spancap * 2 : 1024;
+    savespan *spans = realloc(E.save.spans, sizeof(savespan) * cap);
+    if (spans == NULL)
+      die("realloc");
+    E.save.spans = spans;
+    E.save.spancap = cap;
+  }
+  E.save.spans[E.save.nspans].chars = chars;
+  E.save.spans[E.save.nspans].len = len;
+  E.save.spans[E.save.nspans].newline = newline;
+  E.save.spans[E.save.nspans].fold = fold;
+  E.save.nspans++;
+}
+
+
+void editorSaveSnapshot() { // record every row's bytes without copying them
+  E.save.gen++;
+  E.save.nspans = 0;
+  E.save.total = 0;
+
+  rowiter it = rowIterAt(0);
+  rownode *leaf;
+  while ((leaf = rowIterLeaf(&it)) != NULL) {
+    if (leaf->fold) { // folded lines go out as one piece, the worker drops any \r ending them
+      int withnl = leaf->fold[leaf->foldlen - 1] == '\n';
+      editorSaveSpan(leaf->fold, leaf->foldlen, !withnl, 1);
+      E.save.total += leaf->foldlen + !withnl;
+      it.leaf = leaf->next;
+      it.i = 0;
+      continue;
+    }
+
+    // a mapped row followed by a plain \n takes its newline from the
+    // mapping too, so untouched stretches of the file become one span;
+    // heap rows are shared instead, and copied by the next edit
+    erow *row = rowIterNext(&it);
+    int withnl = row->mapped && row->chars + row->size < E.map + E.maplen &&
+      row->chars[row->size] == '\n';
+    if (!row->mapped)
+      row->savegen = E.save.gen;
+    editorSaveSpan(row->chars, row->size + withnl, !withnl, 0);
+    E.save.total += row->size + 1;
+  }
+}
+
+
+void editorSaveProgress(long long written, int finished, int error) { // report to the main loop
+  pthread_mutex_lock(&E.save.lock);
+  long long total = E.save.total ? E.save.total : 1;
+  int wake = finished || written * 100 / total != E.save.written * 100 / total;
+  E.save.written = written;
+  E.save.finished = finished;
+  E.save.error = error;
+  pthread_mutex_unlock(&E.save.lock);
+
+  if (wake)
+    write(E.save.wake[1], "", 1);
+}
+
+
+void editorSaveFlush(savebatch *b) { // write out the gathered pieces
+  if (b->ok && b->n)
+    b->ok = editorWriteAll(b->fd, b->iov, b->n) != -1;
+  b->written += b->len;
+  b->n = 0;
+  b->len = 0;
+  editorSaveProgress(b->written, 0, 0);
+}
+
+
+void editorSavePiece(savebatch *b, char *p, size_t len) {
+  if (len == 0)
+    return;
+  b->iov[b->n].iov_base = p;
+  b->iov[b->n].iov_len = len;
+  b->n++;
+  b->len += len;
+  if (b->n == KILO_SAVE_IOV)
+    editorSaveFlush(b);
+}
+
+
+void editorSaveLines(savebatch *b, char *p, char *end) { // folded lines, each without the \r rows drop
+  static char newline = '\n';
+  char *run = p; // lines with a plain \n go out together, straight from the mapping
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    char *cut = eol;
+    while (cut > p && cut[-1] == '\r')
+      cut--;
+    if (cut < eol) {
+      editorSavePiece(b, run, cut - run);
+      if (nl)
+        editorSavePiece(b, &newline, 1);
+      run = nl ? nl + 1 : end;
+    }
+    p = nl ? nl + 1 : end;
+  }
+  editorSavePiece(b, run, end - run);
+}
+
+
+void *editorSaveWorker(void *arg) { // writes the snapshot beside the file and renames it over
+  (void)arg;
+  static char newline = '\n';
+  char *path = E.save.path;
+
+  // a crash leaves either the old file or the new one; rows still mapped
+  // from the old file stay readable after the rename
+  char *real = realpath(path, NULL); // saving through a symlink updates its target
+  if (real)
+    path = real;
+  char *slash = strrchr(path, '/');
+  int dirlen = slash ? slash - path + 1 : 0;
+  int tmplen = strlen(path) + 16;
+  char *tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%.*s.%s.XXXXXX", dirlen, path, path + dirlen);
+
+  int ok = 0;
+  long long written = 0;
+  int fd = mkstemp(tmp);
+  if (fd != -1) {
+    struct stat st;
+    if (stat(path, &st) == 0) { // keep the file's mode and owner
+      fchmod(fd, st.st_mode & 07777);
+      fchown(fd, st.st_uid, st.st_gid);
+    }
+    else {
+      mode_t mask = umask(0);
+      umask(mask);
+      fchmod(fd, 0644 & ~mask);
+    }
+
+    savebatch b;
+    b.fd = fd;
+    b.n = 0;
+    b.len = 0;
+    b.written = 0;
+    b.ok = 1;
+    for (int j = 0; j < E.save.nspans && b.ok; j++) {
+      savespan *span = &E.save.spans[j];
+      if (span->fold && memchr(span->chars, '\r', span->len)) // only ever paged in here, off the main thread
+        editorSaveLines(&b, span->chars, span->chars + span->len);
+      else
+        editorSavePiece(&b, span->chars, span->len);
+      if (span->newline)
+        editorSavePiece(&b, &newline, 1);
+    }
+    editorSaveFlush(&b);
+    ok = b.ok;
+    written = b.written;
+
+    if (ok && fsync(fd) == -1)
+      ok = 0;
+    if (close(fd) == -1)
+      ok = 0;
+    if (ok && rename(tmp, path) == -1)
+      ok = 0;
+    if (!ok) {
+      int saved_errno = errno;
+      unlink(tmp);
+      errno = saved_errno;
+    }
+  }
+  int error = ok ? 0 : errno;
+
+  if (ok) {
+    char *dir = dirlen ? strndup(path, dirlen) : strdup(".");
+    int dirfd = open(dir, O_RDONLY);
+    if (dirfd != -1) { // make the rename itself durable
+      fsync(dirfd);
+      close(dirfd);
+    }
+    free(dir);
+  }
+  free(tmp);
+  free(real);
+
+  editorSaveProgress(written, 1, error);
+  return NULL;
+}
+
+
+void editorSaveFinish() { // join the save thread and settle the buffer's state
+  if (!E.save.running)
+    return;
+  pthread_join(E.save.thread, NULL);
+  E.save.running = 0; // rows stop being shared here
+
+  for (int j = 0; j < E.save.nretired; j++)
+    free(E.save.retired[j]);
+  E.save.nretired = 0;
+  free(E.save.path);
+  E.save.path = NULL;
+
+  char buf[64];
+  while (read(E.save.wake[0], buf, sizeof(buf)) > 0)
+    ;
+
+  if (E.save.error == 0) {
+    E.dirty -= E.save.dirty; // edits made while saving still need a save
+    editorSwapSaved();
+    editorSetStatusMessage("%lld bytes written to disk", E.save.written);
+  }
+  else {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(E.save.error));
+  }
+}
+
+
+int editorSaveIdle() { // follow a running save, 1 if the screen changed
+  if (!E.save.running)
+    return 0;
+
+  char buf[64];
+  while (read(E.save.wake[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&E.save.lock);
+  int finished = E.save.finished;
+  int progress = E.save.written * 100 / (E.save.total ? E.save.total : 1);
+  pthread_mutex_unlock(&E.save.lock);
+
+  if (finished) {
+    editorSaveFinish();
+    return 1;
+  }
+  if (progress == E.save.progress)
+    return 0;
+  E.save.progress = progress;
+  return 1;
+}
+
+
+void editorSave() {
+  if (E.save.running) {
+    editorSetStatusMessage("Still saving, try again when it is done");
+    return;
+  }
+
+  if (E.filename == NULL) { // if no file open
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+editorSelectSyntaxHighlight();
+  }
+
+  if (E.swap.path == NULL) // a new file is journaled from its first save
+    editorSwapStart(0);
+  E.swap.snapoff = E.swap.logged;
+
+  // the rows are captured as they are now and written out on another
+  // thread while editing goes on
+  editorSaveSnapshot();
+  E.save.path = strdup(E.filename);
+  E.save.dirty = E.dirty;
+  E.save.progress = 0;
+  E.save.written = 0;
+  E.save.finished = 0;
+  E.save.error = 0;
+  if (pthread_create(&E.save.thread, NULL, editorSaveWorker, NULL) != 0)
+    die("pthread_create");
+  E.save.running = 1;
+}
+
+/*** swap file ***/
+
+#define SWAP_SIZE(len) (UNDO_SIZE(len) - sizeof(int)) // records on disk drop the trailing size
+
+char *editorSwapPath(char *filename) { // dir/name is journaled in dir/.name.kswp
+  char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  int len = strlen(filename) + 8;
+  char *path = malloc(len);
+  snprintf(path, len, "%.*s.%s.kswp", dirlen, filename, filename + dirlen);
+  return path;
+}
+
+
+void editorSwapBase(swapheader *hdr) { // header naming the file as it is on disk now
+  struct stat st;
+  memcpy(hdr->magic, "KILOSWP1", 8);
+  hdr->size = -1;
+  hdr->mtime = 0;
+  if (stat(E.filename, &st) == 0) {
+    hdr->size = st.st_size;
+    hdr->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+}
+
+
+int editorSwapWriteAll(int fd, char *buf, size_t len) { // -1 on error
+  struct iovec iov = {buf, len};
+  return editorWriteAll(fd, &iov, 1);
+}
+
+
+int editorSwapCreate(swapheader *hdr, char *from, size_t len) { // new swap file holding hdr and records, -1 on error
+  int tmplen = strlen(E.swap.path) + 8;
+  char *tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%s.XXXXXX", E.swap.path);
+
+  int fd = mkstemp(tmp);
+  if (fd != -1 && (editorSwapWriteAll(fd, (char *)hdr, sizeof(*hdr)) == -1 ||
+      editorSwapWriteAll(fd, from, len) == -1 || rename(tmp, E.swap.path) == -1)) {
+    close(fd);
+    unlink(tmp);
+    fd = -1;
+  }
+  free(tmp);
+  return fd;
+}
+
+
+void editorSwapRestart() { // on the writer: the journal now starts from the file just saved
+  long long end = lseek(E.swap.fd, 0, SEEK_END);
+  size_t len = end > E.swap.rebasefrom ? end - E.swap.rebasefrom : 0;
+  char *tail = malloc(len ? len : 1); // edits made while the save ran
+  if (pread(E.swap.fd, tail, len, E.swap.rebasefrom) != (ssize_t)len)
+    len = 0;
+
+  int fd = editorSwapCreate(&E.swap.base, tail, len);
+  if (fd != -1) {
+    fdatasync(fd);
+    close(E.swap.fd);
+    E.swap.fd = fd;
+  }
+  free(tail);
+}
+
+
+void *editorSwapWriter(void *arg) { // writes records in batches, one fdatasync per batch
+  (void)arg;
+  char *batch = NULL;
+  size_t batchcap = 0;
+
+  pthread_mutex_lock(&E.swap.lock);
+  while (1) {
+    while (E.swap.len == 0 && !E.swap.rebase && !E.swap.quit)
+      pthread_cond_wait(&E.swap.cond, &E.swap.lock);
+    if (E.swap.len == 0 && !E.swap.rebase)
+      break; // quit with everything written
+
+    // take every record logged so far; whatever arrives while this batch
+    // is on its way to disk goes out with the next one
+    char *records = E.swap.buf;
+    size_t len = E.swap.len;
+    size_t cap = E.swap.cap;
+    E.swap.buf = batch;
+    E.swap.cap = batchcap;
+    E.swap.len = 0;
+    batch = records;
+    batchcap = cap;
+    int rebase = E.swap.rebase;
+    E.swap.rebase = 0;
+    E.swap.busy = 1;
+    pthread_mutex_unlock(&E.swap.lock);
+
+    if (len && editorSwapWriteAll(E.swap.fd, records, len) != -1)
+      fdatasync(E.swap.fd);
+    if (rebase)
+      editorSwapRestart();
+
+    pthread_mutex_lock(&E.swap.lock);
+    E.swap.busy = 0;
+    pthread_cond_broadcast(&E.swap.cond);
+  }
+  pthread_mutex_unlock(&E.swap.lock);
+  free(batch);
+  return NULL;
+}
+
+
+void editorSwapRun() { // hand the open swap file to the writer
+  E.swap.len = 0;
+  E.swap.busy = 0;
+  E.swap.rebase = 0;
+  E.swap.quit = 0;
+  if (pthread_create(&E.swap.writer, NULL, editorSwapWriter, NULL) != 0)
+    die("pthread_create");
+}
+
+
+void editorSwapStart(int ondisk) { // journal edits to E.filename, made to it as it is on disk if ondisk
+  swapheader hdr;
+  editorSwapBase(&hdr);
+  if (!ondisk)
+    hdr.size = -2; // matches no file until a save lands and restarts the journal
+  E.swap.path = editorSwapPath(E.filename);
+  E.swap.fd = editorSwapCreate(&hdr, NULL, 0);
+  if (E.swap.fd == -1) { // e.g. a read only directory, edit without a journal
+    free(E.swap.path);
+    E.swap.path = NULL;
+    return;
+  }
+  E.swap.logged = sizeof(hdr);
+  editorSwapRun();
+}
+
+
+void editorSwapLog(int kind, int append, int y, int x, int y2, int x2, char *s, int len) { // journal an edit
+  if (E.swap.path == NULL)
+    return;
+  if (kind == UNDO_DELETE) // replay finds deleted text in the rows
+    len = 0;
+
+  size_t size = SWAP_SIZE(len);
+  pthread_mutex_lock(&E.swap.lock);
+  if (E.swap.len + size > E.swap.cap) {
+    E.swap.cap = E.swap.len + size > E.swap.cap * 2 ? E.swap.len + size : E.swap.cap * 2;
+    E.swap.buf = realloc(E.swap.buf, E.swap.cap);
+    if (E.swap.buf == NULL)
+      die("realloc");
+  }
+  undoop *op = (undoop *)&E.swap.buf[E.swap.len];
+  memset(op, 0, size);
+  op->kind = kind;
+  op->append = append;
+  op->len = len;
+  op->y = y;
+  op->x = x;
+  op->y2 = y2;
+  op->x2 = x2;
+  op->cy = E.cy;
+  op->cx = E.cx;
+  if (len)
+    memcpy(undoText(op), s, len);
+  E.swap.len += size;
+  pthread_cond_signal(&E.swap.cond);
+  pthread_mutex_unlock(&E.swap.lock);
+  E.swap.logged += size;
+}
+
+
+int editorSwapValid(undoop *op) { // 1 if op can be applied to the rows as they are
+  if (op->y < 0 || op->x < 0)
+    return 0;
+  if (op->kind == UNDO_INSERT) {
+    if (op->y == E.numrows)
+      return op->x == 0;
+    return op->y < E.numrows && op->x <= editorRowAt(op->y)->size;
+  }
+  if (op->kind != UNDO_DELETE || op->y2 < op->y)
+    return 0;
+  if (op->append) // rows from y on, undoing Enter on the line past the end leaves y2 there
+    return op->y < E.numrows;
+  if (op->y2 >= E.numrows)
+    return 0;
+  return op->x <= editorRowAt(op->y)->size && op->x2 <= editorRowAt(op->y2)->size &&
+    (op->y < op->y2 || op->x <= op->x2);
+}
+
+
+long long editorSwapReplay(char *buf, long long size, int *stuck) { // apply journaled edits, returns where the good ones end
+  long long off = sizeof(swapheader);
+  int n = 0;
+  *stuck = 0;
+  while (off + (long long)sizeof(undoop) <= size) {
+    undoop *op = (undoop *)&buf[off];
+    if (op->len >= 0 && off + (long long)SWAP_SIZE(op->len) > size)
+      break; // a record the crash cut short
+    if (op->len < 0 || !editorSwapValid(op)) {
+      *stuck = 1; // whole, but it does not fit the rows; what follows may still matter
+      break;
+    }
+    editorUndoApply(op, op->kind == UNDO_INSERT);
+    E.cy = op->kind == UNDO_INSERT ? op->y2 : op->y;
+    E.cx = op->kind == UNDO_INSERT ? op->x2 : op->x;
+    off += SWAP_SIZE(op->len);
+    n++;
+  }
+  if (n)
+    editorSetStatusMessage("Recovered %d unsaved edits, save to keep them", n);
+  return off;
+}
+
+
+void editorSwapOpen() { // offer the edits a crashed session left for this file, then journal
+  char *path = editorSwapPath(E.filename);
+  int fd = open(path, O_RDWR);
+  struct stat st;
+  if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(swapheader)) {
+    char *buf = malloc(st.st_size);
+    swapheader now;
+    editorSwapBase(&now);
+    // edits only replay onto the exact file they were made to
+    if (pread(fd, buf, st.st_size, 0) == st.st_size && !memcmp(buf, &now, sizeof(now))) {
+      char *answer = editorPrompt("Unsaved edits to this file survived a crash, recover them? (y/n) %s", NULL);
+      int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+      free(answer);
+      if (yes) {
+        int stuck;
+        long long end = editorSwapReplay(buf, st.st_size, &stuck);
+        free(buf);
+        if (stuck) { // move the journal aside whole rather than cut off edits that would not apply
+          close(fd);
+          size_t len = strlen(path) + sizeof(".bad");
+          char *kept = malloc(len);
+          if (kept == NULL) die("malloc");
+          snprintf(kept, len, "%s.bad", path);
+          if (rename(path, kept) == 0) {
+            editorSwapStart(0); // the recovered edits are not on disk
+            editorSetStatusMessage("Could not replay every edit, the journal was kept in %s", kept);
+          } else { // left where it is, edit without a journal so nothing writes over it
+            editorSetStatusMessage("Could not replay every edit, the journal was kept in %s", path);
+          }
+          free(kept);
+          free(path);
+          return;
+        }
+        if (ftruncate(fd, end) == 0 && lseek(fd, end, SEEK_SET) == end) {
+          E.swap.path = path; // keep journaling after the recovered edits
+          E.swap.fd = fd;
+          E.swap.logged = end;
+          editorSwapRun();
+          return;
+        }
+        close(fd);
+        free(path);
+        editorSwapStart(0); // the recovered edits are not on disk
+        return;
+      }
+    }
+    free(buf);
+  }
+  if (fd != -1)
+    close(fd);
+  free(path);
+  editorSwapStart(1);
+}
+
+
+void editorSwapSaved() { // a save landed: restart the journal from the saved file
+  if (E.swap.path == NULL)
+    return;
+  pthread_mutex_lock(&E.swap.lock);
+  E.swap.rebase = 1;
+  E.swap.rebasefrom = E.swap.snapoff;
+  editorSwapBase(&E.swap.base);
+  pthread_cond_signal(&E.swap.cond);
+  pthread_mutex_unlock(&E.swap.lock);
+  E.swap.logged = sizeof(swapheader) + E.swap.logged - E.swap.snapoff;
+}
+
+
+void editorSwapClose() { // stop journaling and drop the swap file
+  if (E.swap.path == NULL)
+    return;
+  pthread_mutex_lock(&E.swap.lock);
+  E.swap.quit = 1;
+  pthread_cond_signal(&E.swap.cond);
+  pthread_mutex_unlock(&E.swap.lock);
+  pthread_join(E.swap.writer, NULL);
+  close(E.swap.fd);
+  unlink(E.swap.path);
+  free(E.swap.path);
+  E.swap.path = NULL;
+}
+
+/*** find ***/
+
+char *editorSearchMem(const char *hay, size_t n, const char *needle, size_t m) { // first needle in hay
+  if (m == 0)
+    return (char *)hay;
+  if (m > n)
+    return NULL;
+
+  size_t end = n - m + 1; // positions a match can start at
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // test 16 starts at once: keep the ones whose first and last bytes both
+  // match, only those are compared in full
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[m - 1]);
+  while (end >= 16 && i < end) {
+    size_t skip = 0;
+    if (i + 16 > end) { // last block overlaps the previous one, mask the starts already tried
+      skip = i - (end - 16);
+      i = end - 16;
+    }
+
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+          _mm_cmpeq_epi8(b, last)));
+    mask &= ~0u << skip;
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (m <= 2 || !memcmp(hay + i + bit + 1, needle + 1, m - 2))
+        return (char *)hay + i + bit;
+      mask &= mask - 1;
+    }
+    i += 16;
+  }
+#endif
+
+  while (i < end) { // memchr for the first byte covers the tail and non-sse2 builds
+    const char *p = memchr(hay + i, needle[0], end - i);
+    if (p == NULL)
+      return NULL;
+    i = p - hay;
+    if (hay[i + m - 1] == needle[m - 1] && !memcmp(p, needle, m))
+      return (char *)p;
+    i++;
+  }
+  return NULL;
+}
+
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at)); //allocates space for new line
-  for (int j = at + 1; j <= E.numrows; j++)
-    E.row[j].idx++;
+int editorRowFind(int filerow, char *query, int qlen) { // render column of the first match or -1
+  erow *row = editorRowAt(filerow);
 
-  E.row[at].idx = at;
+  // render only differs from chars by tabs turned into spaces, so unless
+  // the query has a space that could land in one, chars can be searched
+  // directly without rendering the row
+  if (memchr(query, ' ', qlen) && memchr(row->chars, '\t', row->size)) {
+    editorRowMaterialize(filerow);
+    rcentry *e = rowCacheGet(row);
+    char *render = rowCacheRender(row, e);
+    char *match = editorSearchMem(render, e->rsize, query, qlen);
+    return match ? match - render : -1;
+  }
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-  
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]); // update render rsize
-  
-  E.numrows++;
-  E.dirty++;
+  char *match = editorSearchMem(row->chars, row->size, query, qlen);
+  return match ? editorRowCxToRx(row, match - row->chars) : -1;
 }
 
 
-void editorFreeRow(erow *row) { // free row space/delete row
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+int editorRowHasMatch(erow *row, findjob *job, char **tmp, int *tmpcap) { // editorRowFind for the worker, reads chars only
+  if (!job->spacey || !memchr(row->chars, '\t', row->size))
+    return editorSearchMem(row->chars, row->size, job->query, job->qlen) != NULL;
+
+  int need = row->size * KILO_TAB_STOP; // expand tabs the way render does
+  if (need > *tmpcap) {
+    char *grown = realloc(*tmp, need);
+    if (grown == NULL)
+      die("realloc");
+    *tmp = grown;
+    *tmpcap = need;
+  }
+  int len = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      (*tmp)[len++] = ' ';
+      while (len % KILO_TAB_STOP != 0)
+        (*tmp)[len++] = ' ';
+    }
+    else {
+      (*tmp)[len++] = row->chars[j];
+    }
+  }
+  return editorSearchMem(*tmp, len, job->query, job->qlen) != NULL;
 }
 
 
-void editorDelRow(int at) { // del at row begining
-  if (at < 0 || at >= E.numrows)
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at -1)); // move row up 1
-  for (int j = at; j < E.numrows - 1; j++)
-    E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+int editorFindPublish(int *hits, int n, int finished) { // hand rows to the main loop, 0 once cancelled
+  pthread_mutex_lock(&E.find.lock);
+  int cancel = E.find.cancel;
+  int wake = 0;
+  if (!cancel && (n || finished)) {
+    wake = E.find.nfound == 0 || finished; // otherwise a wakeup is already pending
+    if (E.find.nfound + n > E.find.foundcap) {
+      int cap = (E.find.nfound + n) * 2;
+      int *found = realloc(E.find.found, sizeof(int) * cap);
+      if (found == NULL)
+        die("realloc");
+      E.find.found = found;
+      E.find.foundcap = cap;
+    }
+    if (n) // found is still NULL when a search ends without a hit
+      memcpy(&E.find.found[E.find.nfound], hits, sizeof(int) * n);
+    E.find.nfound += n;
+    E.find.finished = finished;
+  }
+  pthread_mutex_unlock(&E.find.lock);
+
+  if (wake)
+    write(E.find.wake[1], "", 1);
+  return !cancel;
 }
 
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) 
-    at = row->size;
-  
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // makes room for char at index at
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
-}
+#define KILO_FIND_RUN 1024 // most rows searched in one pass
 
+int editorFindFold(rownode *leaf, int from, int filerow, findjob *job,
+    int *hits, int *nhits, char **tmp, int *tmpcap) { // search a folded leaf from line from on, 0 once cancelled
+  char *p = rowFoldLine(leaf, from);
+  char *end = leaf->fold + leaf->foldlen;
+  int bytab = job->spacey && memchr(p, '\t', end - p); // rendered tabs matter, go line by line
+  int j = 0; // line p starts, counted from from
+  char *match;
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1); // new row including null
-  memcpy(&row->chars[row->size], s, len); // copy the string
-  row->size += len; // new len
-  row->chars[row->size] = '\0'; // terminate row with null
-  editorUpdateRow(row);
-  E.dirty++;
-}
+  while (p < end) {
+    if (*nhits == 2 * KILO_FIND_RUN) {
+      if (!editorFindPublish(hits, *nhits, 0))
+        return 0;
+      *nhits = 0;
+    }
 
+    if (bytab) {
+      erow row;
+      char *next = rowMapLine(&row, p, end);
+      if (editorRowHasMatch(&row, job, tmp, tmpcap))
+        hits[(*nhits)++] = filerow + j;
+      p = next;
+      j++;
+      continue;
+    }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size)
-    return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at); // move row left one with null at the end
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+    if ((match = editorSearchMem(p, end - p, job->query, job->qlen)) == NULL)
+      break;
+    char *nl;
+    while ((nl = memchr(p, '\n', match - p)) != NULL) { // line the match starts in
+      p = nl + 1;
+      j++;
+    }
+    hits[(*nhits)++] = filerow + j;
+    if ((nl = memchr(match, '\n', end - match)) == NULL)
+      break;
+    p = nl + 1; // one hit per line is enough
+    j++;
+  }
+  return 1;
 }
 
-/** editor operations ***/
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) { // cursor rests on tilde
-    editorInsertRow(E.numrows, "", 0); // add a row
+void *editorFindWorker(void *arg) { // searches the job's rows off the main thread
+  findjob *job = arg;
+  int hits[2 * KILO_FIND_RUN];
+  int nhits = 0;
+  char *starts[KILO_FIND_RUN];
+  char *tmp = NULL;
+  int tmpcap = 0;
+  int filerow = 0;
+
+  // the main thread may unfold leaves to draw while this runs, so the
+  // tree is only read under rowlock, and found again after letting go
+  pthread_rwlock_rdlock(&E.rowlock);
+  rowiter it = rowIterAt(0);
+
+  if (job->cand) { // narrowing, only the old matches can still match
+    for (int j = 0; j < job->ncand; j++) {
+      rowIterSkip(&it, job->cand[j] - filerow);
+      filerow = job->cand[j] + 1;
+      if (editorRowHasMatch(rowIterNext(&it), job, &tmp, &tmpcap))
+        hits[nhits++] = job->cand[j];
+      if ((j + 1) % KILO_FIND_RUN == 0) {
+        if (!editorFindPublish(hits, nhits, 0))
+          goto out;
+        nhits = 0;
+      }
+    }
+    pthread_rwlock_unlock(&E.rowlock);
+    editorFindPublish(hits, nhits, 1);
+    goto done;
   }
 
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
-}
+  int since = 0; // rows searched since the last publish
+  while (filerow < job->numrows) {
+    rownode *leaf = rowIterLeaf(&it);
+    int n;
+    if (leaf->fold) { // a stretch of the file nothing has been made of
+      n = leaf->count - it.i;
+      if (!editorFindFold(leaf, it.i, filerow, job, hits, &nhits, &tmp, &tmpcap))
+        goto out;
+      it.leaf = leaf->next;
+      it.i = 0;
+    }
+    else {
+      rowiter first = it;
+      erow *row = rowIterNext(&it);
+      n = 1;
 
+      if (!row->mapped) {
+        if (editorRowHasMatch(row, job, &tmp, &tmpcap))
+          hits[nhits++] = filerow;
+      }
+      else {
+        // untouched rows usually sit back to back in the mapping with only
+        // line endings between them, which a query can never match, so a run
+        // of them is searched as one buffer
+        char *end = row->chars + row->size;
+        starts[0] = row->chars;
+        rowiter peek = it;
+        while (filerow + n < job->numrows && n < KILO_FIND_RUN) {
+          erow *next = rowIterNext(&peek);
+          if (next == NULL || !next->mapped || next->chars < end || next->chars - end > 2)
+            break;
+          starts[n++] = next->chars;
+          end = next->chars + next->size;
+          it = peek;
+        }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0); // if there is nothing in current row
-  }
-  else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx); // write current row
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0'; // terminate new row
-    editorUpdateRow(row); // add new row or other half of exising row
+        if (job->spacey && memchr(starts[0], '\t', end - starts[0])) { // rendered tabs matter, go row by row
+          for (int j = 0; j < n; j++)
+            if (editorRowHasMatch(rowIterNext(&first), job, &tmp, &tmpcap))
+              hits[nhits++] = filerow + j;
+        }
+        else {
+          char *p = starts[0];
+          int j = 0;
+          char *match;
+          while ((match = editorSearchMem(p, end - p, job->query, job->qlen)) != NULL) {
+            while (j + 1 < n && starts[j + 1] <= match) // row the match starts in
+              j++;
+            hits[nhits++] = filerow + j;
+            if (++j == n)
+              break;
+            p = starts[j]; // one hit per row is enough
+          }
+        }
+      }
+    }
+
+    filerow += n;
+    since += n;
+    if (since >= KILO_FIND_RUN) { // also where a cancel is noticed
+      pthread_rwlock_unlock(&E.rowlock);
+      if (!editorFindPublish(hits, nhits, 0))
+        goto done;
+      nhits = 0;
+      since = 0;
+      pthread_rwlock_rdlock(&E.rowlock);
+      it = rowIterAt(filerow);
+    }
   }
-  E.cy++;
-  E.cx = 0;
+  pthread_rwlock_unlock(&E.rowlock);
+  editorFindPublish(hits, nhits, 1);
+  goto done;
+
+out:
+  pthread_rwlock_unlock(&E.rowlock);
+done:
+  free(tmp);
+  return NULL;
 }
 
 
-void editorDelChar() {
-  if (E.cy == E.numrows)
-    return;
-  if (E.cx == 0 && E.cy == 0) // cant delete first line
+void editorFindStop() { // cancel the worker and wait for it to exit
+  if (!E.find.running)
     return;
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--; // decriment for deleted char
-  }
-  else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size); // appends row up 1
-    editorDelRow(E.cy);
-    E.cy--;
-  }
+  pthread_mutex_lock(&E.find.lock);
+  E.find.cancel = 1;
+  pthread_mutex_unlock(&E.find.lock);
+  pthread_join(E.find.worker, NULL);
+  E.find.running = 0;
+
+  E.find.cancel = 0;
+  E.find.finished = 0;
+  E.find.nfound = 0;
+  free(E.find.job.query);
+  free(E.find.job.cand);
+  E.find.job.query = NULL;
+  E.find.job.cand = NULL;
+
+  char buf[64];
+  while (read(E.find.wake[0], buf, sizeof(buf)) > 0) // drop stale wakeups
+    ;
 }
 
-/*** file i/o ***/
-
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) // sum length of each row + 1 for new line
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size); // copy each row to buffer end
-    p += E.row[j].size;
-    *p = '\n'; // add new line at end of each row
-    p++;
-  }
 
-  return buf; // returns string of whole file
+void editorFindStart(int *cand, int ncand) { // search for E.find.query on the worker
+  // the prompt is modal, so no row can change until the search is stopped;
+  // drawing may still unfold leaves, which it does under rowlock, and
+  // otherwise only touches render and hl, which the worker never reads
+  E.find.job.query = strdup(E.find.query);
+  E.find.job.qlen = strlen(E.find.query);
+  E.find.job.spacey = memchr(E.find.query, ' ', E.find.job.qlen) != NULL;
+  E.find.job.numrows = E.numrows;
+  E.find.job.cand = cand;
+  E.find.job.ncand = ncand;
+  E.find.done = 0;
+
+  if (pthread_create(&E.find.worker, NULL, editorFindWorker, &E.find.job) != 0)
+    die("pthread_create");
+  E.find.running = 1;
 }
 
 
-void editorOpen(char *filename) { // open and read a file line by line and pass it to append
-  free(E.filename);
-  E.filename = strdup(filename);
+void editorFindAdd(int filerow) {
+  if (E.find.n == E.find.cap) {
+    int cap = E.find.cap ? E.find.cap * 2 : 256;
+    int *rows = realloc(E.find.rows, sizeof(int) * cap);
+    if (rows == NULL)
+      die("realloc");
+    E.find.rows = rows;
+    E.find.cap = cap;
+  }
+  E.find.rows[E.find.n++] = filerow;
+}
 
-  editorSelectSyntaxHighlight();
-  
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen -1] == '\r'))
-      linelen--;
+int editorRowNextMatch(erow *row, int from, char *query, int qlen) { // render column of a hit at or after from, -1 if none
+  rcentry *e = rowCacheGet(row); // the row was just drawn, so it is cached
+  if (from >= e->rsize)
+    return -1;
+  char *render = rowCacheRender(row, e);
+  char *match = editorSearchMem(&render[from], e->rsize - from, query, qlen);
+  return match ? match - render : -1;
+}
 
-    editorInsertRow(E.numrows, line, linelen);
-  }
 
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+void editorFindJump() { // put the cursor on the current match
+  int current = E.find.rows[E.find.cur];
+  int rx = editorRowFind(current, E.find.query, strlen(E.find.query));
+  E.cy = current;
+  E.cx = editorRowRxToCx(editorRowAt(current), rx);
+  E.rowoff = E.numrows; // scrolls the match to the top of the screen
 }
 
 
-void editorSave() {
-  if (E.filename == NULL) { // if no file open
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-editorSelectSyntaxHighlight();
-  }
-  
-  int len;
-  char *buf = editorRowsToString(&len); // converts file to strings
+int editorFindIdle() { // merge rows the worker has found, 1 if the screen changed
+  if (!E.find.running)
+    return 0;
 
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) { // sets file length
-      if (write(fd, buf, len) == len) { // writes out
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
+  char buf[64];
+  while (read(E.find.wake[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&E.find.lock);
+  int merged = E.find.nfound;
+  for (int j = 0; j < E.find.nfound; j++)
+    editorFindAdd(E.find.found[j]);
+  E.find.nfound = 0;
+  int finished = E.find.finished;
+  pthread_mutex_unlock(&E.find.lock);
+
+  if (finished) {
+    editorFindStop();
+    E.find.done = 1;
   }
-
-  free(buf); // frees string mem
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  if (E.find.cur == -1 && E.find.n > 0) { // first hit of a new query
+    E.find.cur = 0;
+    editorFindJump();
+  }
+  return merged || finished;
 }
 
-/*** find ***/
 
-void editorFindCallback(char *query, int key) { // function to continously search
-  static int last_match = -1;
-  static int direction = 1;
+void editorFindReset() { // stop searching and forget the matches
+  editorFindStop();
+  free(E.find.query);
+  E.find.query = NULL;
+  E.find.n = 0;
+  E.find.cur = -1;
+  E.find.done = 0;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+void editorFindCallback(char *query, int key) { // function to continously search
+  if (key == '\r' || key == '\x1b') { // search is over
+    editorFindReset();
+    return;
   }
-  
-  
-  if (key == '\r' || key == '\x1b') { // logic for moving forward and back
-    last_match = -1;
-    direction = 1;
+
+  if (query[0] == '\0') {
+    editorFindReset();
     return;
   }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
-    direction = 1;
-  else if (key == ARROW_LEFT || key == ARROW_UP)
-    direction = -1;
-  else {
-    last_match = -1;
-    direction = 1;
+
+  if (E.find.query == NULL || strcmp(query, E.find.query)) { // query changed
+    // typing only narrows the matches of a finished search, anything
+    // else needs a full scan; so does a folded file, as narrowing walks
+    // the old matches row by row
+    int grew = E.find.done && !strncmp(query, E.find.query, strlen(E.find.query)) && !E.huge;
+    editorFindStop();
+    free(E.find.query);
+    E.find.query = strdup(query);
+    E.find.cur = -1;
+
+    if (grew && E.find.n == 0) // nothing left to narrow
+      return;
+    int *cand = NULL;
+    int ncand = 0;
+    if (grew) { // the worker takes the old matches over
+      cand = E.find.rows;
+      ncand = E.find.n;
+      E.find.rows = NULL;
+      E.find.cap = 0;
+    }
+    E.find.n = 0;
+    editorFindStart(cand, ncand); // matches stream in through editorFindIdle
+    return;
   }
-  
 
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
+  if (E.find.n == 0)
+    return;
 
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction; // logic for moving forward and back
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query); // checks if string is present
-    if (match) { // if string is found
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query)); // hihglight matched search
-      break;
-    }
+  // logic for moving forward and back, wrapping only once every row has
+  // been searched
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    if (E.find.cur + 1 < E.find.n)
+      E.find.cur++;
+    else if (E.find.done)
+      E.find.cur = 0;
+  }
+  else if (key == ARROW_LEFT || key == ARROW_UP) {
+    if (E.find.cur > 0)
+      E.find.cur--;
+    else if (E.find.done)
+      E.find.cur = E.find.n - 1;
+  }
+  else {
+    return;
   }
+  editorFindJump();
 }
 
 
@@ -776,21 +3755,246 @@ void editorFind() {
 struct abuf {
   char *b;
   int len;
+  int cap; // bytes allocated, doubled as needed and kept across frames
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
-void abAppend(struct abuf *ab, const char *s, int len) { // putting chars into a buffer
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL)
-    return ;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
+char *abReserve(struct abuf *ab, int len) { // room for len more chars, NULL if out of memory
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return NULL;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  char *at = &ab->b[ab->len];
   ab->len += len;
+  return at;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) { // putting chars into a buffer
+  char *at = abReserve(ab, len);
+  if (at)
+    memcpy(at, s, len);
+}
+
+/*** screen ***/
+
+#define KILO_SCREEN_GAP 8 // unchanged cells cheaper to resend than to jump over
+
+void screenForget() { // the terminal shows something unknown, repaint it all next frame
+  memset(E.screen, 0, sizeof(screencell) * E.screenh * E.screenw); // every cell differs from the next frame
+  E.cursory = -1;
+}
+
+
+void screenResize() { // match the cell grids to the terminal, forgetting what it shows
+  int h = E.screenrows + 2;
+  int w = E.screencols;
+  if (h == E.screenh && w == E.screenw)
+    return;
+
+  E.screen = realloc(E.screen, sizeof(screencell) * h * w);
+  E.frame = realloc(E.frame, sizeof(screencell) * h * w);
+  E.screenh = h;
+  E.screenw = w;
+  screenForget();
+}
+
+
+screencell *screenLine(int y) { // cells of frame row y
+  return &E.frame[y * E.screenw];
+}
+
+
+void screenClear() { // blank the frame before drawing into it
+  screencell blank = {' ', 39, 0};
+  for (int j = 0; j < E.screenh * E.screenw; j++)
+    E.frame[j] = blank;
+}
+
+
+void screenPut(int y, int x, const char *s, int len, int inverse) { // text into the frame, clipped
+  screencell *line = screenLine(y);
+  for (int j = 0; j < len && x + j < E.screenw; j++) {
+    line[x + j].ch = s[j];
+    line[x + j].color = 39;
+    line[x + j].inverse = inverse;
+  }
+}
+
+
+int screenCellEq(screencell *a, screencell *b) {
+  return a->ch == b->ch && a->color == b->color && a->inverse == b->inverse;
+}
+
+
+void screenMoveTo(struct abuf *ab, int y, int x) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+}
+
+
+const char *screen_sgr_fg[] = { // sgr foreground 30 to 39, all five bytes long
+  "\x1b[30m", "\x1b[31m", "\x1b[32m", "\x1b[33m", "\x1b[34m",
+  "\x1b[35m", "\x1b[36m", "\x1b[37m", "\x1b[38m", "\x1b[39m"
+};
+
+
+void screenSetAttr(struct abuf *ab, int *color, int *inverse, screencell *cell) { // sgr changes to draw cell
+  if (cell->inverse != *inverse) {
+    abAppend(ab, cell->inverse ? "\x1b[7m" : "\x1b[27m", cell->inverse ? 4 : 5);
+    *inverse = cell->inverse;
+  }
+  if (cell->color != *color) {
+    abAppend(ab, screen_sgr_fg[cell->color - 30], 5);
+    *color = cell->color;
+  }
+}
+
+
+int screenCellSameAttr(screencell *a, screencell *b) {
+  return a->color == b->color && a->inverse == b->inverse;
+}
+
+
+int screenRowsMatch(int shift) { // text rows of the frame equal to the shown ones shift rows down
+  int same = 0;
+  for (int y = 0; y < E.screenrows; y++) {
+    int from = y + shift;
+    if (from >= 0 && from < E.screenrows &&
+        !memcmp(screenLine(y), &E.screen[from * E.screenw], sizeof(screencell) * E.screenw))
+      same++;
+  }
+  return same;
+}
+
+
+void screenScroll(struct abuf *ab, int shift) { // move shown text rows up by shift, if that saves redrawing them
+  if (shift == 0 || abs(shift) >= E.screenrows)
+    return;
+  if (screenRowsMatch(shift) <= screenRowsMatch(0))
+    return;
+
+  // scroll only the text rows, the status and message bars stay put
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[?25l\x1b[1;%dr\x1b[%d%c\x1b[r",
+      E.screenrows, abs(shift), shift > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+  E.cursory = -1; // resetting the region homes the cursor
+
+  int w = E.screenw;
+  int n = E.screenrows - abs(shift);
+  screencell *top = E.screen;
+  if (shift > 0)
+    memmove(top, &top[shift * w], sizeof(screencell) * n * w);
+  else
+    memmove(&top[-shift * w], top, sizeof(screencell) * n * w);
+
+  screencell plain = {' ', 39, 0}; // rows scrolled in come up blank
+  int first = shift > 0 ? n : 0;
+  for (int j = first * w; j < (first + abs(shift)) * w; j++)
+    top[j] = plain;
 }
 
-void abFree(struct abuf *ab) { // frees space/destructure
-  free(ab->b);
+
+void screenFlush(struct abuf *ab, int cy, int cx) { // send only what differs from the terminal
+  screencell plain = {' ', 39, 0};
+  int color = 39; // every flush leaves the terminal's sgr state at the default
+  int inverse = 0;
+  int drawn = ab->len > 0; // a scroll has already hidden the cursor
+  int w = E.screenw;
+
+  for (int y = 0; y < E.screenh; y++) {
+    screencell *new = screenLine(y);
+    screencell *old = &E.screen[y * w];
+
+    int x0 = 0;
+    while (x0 < w && screenCellEq(&new[x0], &old[x0]))
+      x0++;
+    if (x0 == w)
+      continue;
+    int x1 = w - 1; // last changed cell
+    while (screenCellEq(&new[x1], &old[x1]))
+      x1--;
+    int end = w; // cells from end on are blank, erasing the line draws them
+    while (end > 0 && screenCellEq(&new[end - 1], &plain))
+      end--;
+
+    // bytes past ascii can take fewer columns than cells, so rows that hold
+    // them now or did before are redrawn whole, like every row used to be
+    for (int x = 0; x < w; x++) {
+      if ((unsigned char)new[x].ch >= 0x80 || (unsigned char)old[x].ch >= 0x80) {
+        x0 = 0;
+        x1 = w - 1;
+        break;
+      }
+    }
+
+    if (!drawn) {
+      abAppend(ab, "\x1b[?25l", 6); // hide cursor so it doesnt flicker
+      drawn = 1;
+    }
+    screenMoveTo(ab, y, x0);
+
+    int lim = x1 < end ? x1 + 1 : end;
+    int x = x0;
+    while (x < lim) {
+      if (screenCellEq(&new[x], &old[x])) {
+        int run = x;
+        while (run < lim && screenCellEq(&new[run], &old[run]))
+          run++;
+        if (run - x > KILO_SCREEN_GAP) { // jump over the unchanged cells
+          x = run;
+          screenMoveTo(ab, y, x);
+          continue;
+        }
+      }
+      // send cells up to the next long unchanged stretch, a run of one
+      // color at a time
+      int stop = x + 1;
+      while (stop < lim && screenCellSameAttr(&new[stop], &new[x])) {
+        if (screenCellEq(&new[stop], &old[stop])) {
+          int run = stop;
+          while (run < lim && run - stop <= KILO_SCREEN_GAP && screenCellEq(&new[run], &old[run]))
+            run++;
+          if (run - stop > KILO_SCREEN_GAP)
+            break;
+        }
+        stop++;
+      }
+
+      screenSetAttr(ab, &color, &inverse, &new[x]);
+      char *at = abReserve(ab, stop - x);
+      if (at)
+        for (int j = x; j < stop; j++)
+          *at++ = new[j].ch;
+      x = stop;
+    }
+
+    if (x1 >= end) { // the changes reach the blank tail
+      screenSetAttr(ab, &color, &inverse, &plain);
+      abAppend(ab, "\x1b[K", 3); // clear line
+    }
+  }
+
+  if (drawn || cy != E.cursory || cx != E.cursorx) { // put cursor at E.cx and E.cy
+    screenSetAttr(ab, &color, &inverse, &plain);
+    screenMoveTo(ab, cy, cx);
+    E.cursory = cy;
+    E.cursorx = cx;
+  }
+  if (drawn)
+    abAppend(ab, "\x1b[?25h", 6); // show cursor
+
+  screencell *shown = E.screen;
+  E.screen = E.frame;
+  E.frame = shown;
 }
 
 /*** output ***/
@@ -798,7 +4002,7 @@ void abFree(struct abuf *ab) { // frees space/destructure
 void editorScroll() { // handles cursor scrolling
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
 
   if (E.cy < E.rowoff) { // check if above visible window and scolls accordingly
@@ -816,7 +4020,7 @@ void editorScroll() { // handles cursor scrolling
 }
 
 
-void editorDrawRows(struct abuf *ab) { // draws rows
+void editorDrawRows() { // draws rows
   int y;
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
@@ -829,129 +4033,150 @@ void editorDrawRows(struct abuf *ab) { // draws rows
           welcomelen = E.screencols;
 
         int padding  = (E.screencols - welcomelen) / 2; // centering version
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-          abAppend(ab, " ", 1);
+        if (padding)
+          screenPut(y, 0, "~", 1, 0);
 
-        abAppend(ab, welcome, welcomelen);
+        screenPut(y, padding, welcome, welcomelen, 0);
       }
       else {
-        abAppend(ab, "~", 1); // draws tilde like vim
+        screenPut(y, 0, "~", 1, 0); // draws tilde like vim
       }
     }
-    else { // if file append row
-      int len = E.row[filerow].rsize - E.coloff;
+    else { // if file draw row
+      editorRowMaterialize(filerow);
+      erow *row = editorRowAt(filerow);
+      rcentry *e = rowCacheGet(row);
+      int len = e->rsize - E.coloff;
       if (len < 0)
         len = 0;
       if (len > E.screencols)
         len = E.screencols;
 
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
+      char *c = &rowCacheRender(row, e)[E.coloff];
+      unsigned char *hl = rowCacheHl(e);
+      screencell *line = screenLine(y);
       int j;
 
+      // while searching, every hit on screen is painted as a match; the
+      // next one is found as drawing reaches it
+      int qlen = E.find.query ? (int)strlen(E.find.query) : 0;
+      int mstart = -1; // next hit not yet reached, -1 if none
+      int mend = 0;    // end of the last hit reached
+      if (qlen) {
+        int from = E.coloff - qlen + 1 > 0 ? E.coloff - qlen + 1 : 0;
+        mstart = editorRowNextMatch(row, from, E.find.query, qlen);
+      }
+
       for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
+        while (mstart != -1 && mstart <= E.coloff + j) {
+          mend = mstart + qlen;
+          mstart = editorRowNextMatch(row, mstart + 1, E.find.query, qlen);
         }
-        else if (hl[j] == HL_NORMAL) { // normal highlight
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5 );
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
+        int h = E.coloff + j < mend ? HL_MATCH : hlGet(hl, E.coloff + j);
+
+        if (iscntrl(c[j])) { // control chars show inverted as ^@ style letters
+          line[j].ch = (c[j] <= 26) ? '@' + c[j] : '?';
+          line[j].inverse = 1;
         }
-        else { // special highlight colors
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color); // set proper color
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+        else {
+          line[j].ch = c[j];
+          line[j].color = h == HL_NORMAL ? 39 : editorSyntaxToColor(h);
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
-
-    abAppend(ab, "\x1b[K", 3); // clear line
-    abAppend(ab, "\r\n", 2);
   }
 }
 
 
-void editorDrawStatusBar(struct abuf *ab) { // draws lines and file name
-  abAppend(ab, "\x1b[7m", 4); // invert colors, black on while
+void editorDrawStatusBar() { // draws lines and file name
+  int y = E.screenrows;
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  char saving[16] = "";
+  if (E.save.running)
+    snprintf(saving, sizeof(saving), " saving %d%%", E.save.progress);
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
       E.filename ? E.filename : "[No Name]", E.numrows,
-      E.dirty ? "(modified)" : "");
+      E.dirty ? "(modified)" : "", saving);
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
       E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
 
   if (len > E.screencols)
     len = E.screencols;
-  abAppend(ab, status, len);
+  for (int x = 0; x < E.screencols; x++) // invert colors, black on while
+    screenPut(y, x, " ", 1, 1);
+  screenPut(y, 0, status, len, 1);
+  if (len + rlen <= E.screencols)
+    screenPut(y, E.screencols - rlen, rstatus, rlen, 1);
+}
 
-  while (len < E.screencols) {
-    if (E.screencols - len  == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    }
-    else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+
+int editorFormatCount(char *buf, int n) { // 3401 -> "3,401"
+  char digits[16];
+  int len = snprintf(digits, sizeof(digits), "%d", n);
+  int j = 0;
+  for (int i = 0; i < len; i++) {
+    if (i > 0 && (len - i) % 3 == 0)
+      buf[j++] = ',';
+    buf[j++] = digits[i];
   }
-  abAppend(ab, "\x1b[m", 3); // revert colors
-  abAppend(ab, "\r\n", 2);
+  buf[j] = '\0';
+  return j;
 }
 
 
-void editorDrawMessageBar(struct abuf *ab) { // shows messages for users
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() { // shows messages for users
+  int y = E.screenrows + 1;
   int msglen = strlen(E.statusmsg);
 
-  if (msglen > E.screencols)
-    msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+  char count[64]; // running searches show where they are on the right
+  int countlen = 0;
+  if (E.find.query) {
+    if (E.find.n == 0) {
+      countlen = snprintf(count, sizeof(count), E.find.done ? "no matches" : "searching...");
+    }
+    else {
+      char cur[16], total[16];
+      editorFormatCount(cur, E.find.cur + 1);
+      editorFormatCount(total, E.find.n);
+      countlen = snprintf(count, sizeof(count), "match %s of %s%s", cur, total,
+          E.find.done ? "" : "+"); // still counting
+    }
+    if (countlen >= E.screencols)
+      countlen = 0;
+  }
+
+  if (msglen > E.screencols - countlen)
+    msglen = E.screencols - countlen;
+  if (!(msglen && time(NULL) - E.statusmsg_time < 5))
+    msglen = 0;
+  screenPut(y, 0, E.statusmsg, msglen, 0);
+  if (countlen)
+    screenPut(y, E.screencols - countlen, count, countlen, 0);
 }
 
 
 void editorRefreshScreen() { // drivers display changes
+  E.lastframe = editorNowMs();
+  E.hl_budget = KILO_HL_BUDGET;
   editorScroll();
-  
-  struct abuf ab = ABUF_INIT;
-  
-  abAppend(&ab, "\x1b[?25l", 6); // hide cursor so dpesnt flicker
-  abAppend(&ab, "\x1b[H", 3);  // cursor top left
-
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
-
-  char buf[32]; // put cursor at E.cx and E.cy
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
-
-  abAppend(&ab, "\x1b[?25h", 6); // show cursor
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  screenResize(); // the frame is drawn in full, then only what changed is sent
+  screenClear();
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+
+  static struct abuf ab = ABUF_INIT; // reused, so steady state frames never allocate
+  ab.len = 0;
+  screenScroll(&ab, E.rowoff - E.screenrowoff);
+  E.screenrowoff = E.rowoff;
+  screenFlush(&ab, E.cy - E.rowoff, E.rx - E.coloff);
+  struct iovec iov = {ab.b, ab.len};
+  if (ab.len && editorWriteAll(STDOUT_FILENO, &iov, 1) == -1)
+    screenForget(); // the shadow already holds this frame, whatever got through
+
+  if (E.huge && E.unfolded > KILO_HUGE_WINDOW) // let go of rows the view has left behind
+    rowTreeRefold(E.rowoff - KILO_HUGE_WINDOW / 2, E.rowoff + E.screenrows + KILO_HUGE_WINDOW / 2);
 }
 
 
@@ -974,7 +4199,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) { // provides me
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    if (editorFrameDue())
+      editorRefreshScreen();
+    else
+      editorScroll();
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1010,7 +4238,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) { // provides me
 }
 
 void editorMoveCursor(int key) { // increments/decrements cursor position
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy]; // handle cursor past right edge
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy); // handle cursor past right edge
   
   switch (key) {
     case ARROW_LEFT:
@@ -1018,7 +4246,7 @@ void editorMoveCursor(int key) { // increments/decrements cursor position
         E.cx--;
       else if (E.cy > 0) { // handle cursor wrapping
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -1039,7 +4267,7 @@ void editorMoveCursor(int key) { // increments/decrements cursor position
       break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy]; // handles going from large x row to smaller
+  row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy); // handles going from large x row to smaller
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) 
     E.cx = rowlen;
@@ -1057,12 +4285,14 @@ void editorProcessKeypress() { // process char from editorReadKey()
       break;
 
     case CTRL_KEY('q'):
+      editorSaveFinish(); // let a running save land, it may leave the file clean
       if (E.dirty && quit_times > 0) { // test if ^q pressed enough when file is dirty
         editorSetStatusMessage("WARNING!!! File has unsaved changes. "
             "Press Ctrl-Q %d more times to quit", quit_times);
         quit_times--;
         return;
       }
+      editorSwapClose(); // the edits are saved or given up
       write(STDOUT_FILENO, "\x1b[2J", 4); // escape sequence (x1b), then clear whole screen
       write(STDOUT_FILENO, "\x1b[H", 3);  // cursor top left
       exit(0);
@@ -1078,13 +4308,25 @@ void editorProcessKeypress() { // process char from editorReadKey()
 
     case END_KEY: // end of line
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       break;
 
     case CTRL_KEY('f'): // ^f bound to find
       editorFind();
       break;
 
+    case CTRL_KEY('z'): // ^z bound to undo
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'): // ^y bound to redo
+      editorRedo();
+      break;
+
+    case CTRL_KEY('g'): // ^g bound to compact
+      editorCompact();
+      break;
+
     case BACKSPACE: // delete key
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1117,8 +4359,13 @@ void editorProcessKeypress() { // process char from editorReadKey()
       editorMoveCursor(c);
       break;
 
+    case PASTE_START:
+      editorPaste();
+      break;
+
     case CTRL_KEY('l'):
     case '\x1b':
+    case PASTE_END:
       break;
 
     default: // insertion chars
@@ -1139,33 +4386,124 @@ void initEditor() {
   E.rowoff = 0;      // row offset
   E.coloff = 0;      // col offset
   E.numrows = 0;     // rows in file
-  E.row = NULL;      // file row array
+  E.rows = NULL;     // file row tree
+  E.map = NULL;      // mapping rows borrow chars from
+  E.maplen = 0;
+  E.huge = 0;
+  E.unfolded = 0;
+  pthread_rwlockattr_t rowlockattr; // drawing must not wait out a whole search
+  pthread_rwlockattr_init(&rowlockattr);
+  pthread_rwlockattr_setkind_np(&rowlockattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&E.rowlock, &rowlockattr);
+  pthread_rwlockattr_destroy(&rowlockattr);
   E.dirty = 0;       // file been edited?
   E.filename = NULL; // filename string for status
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;   // null if there is no filetype
+  E.find.query = NULL; // no search running
+  E.find.rows = NULL;
+  E.find.n = 0;
+  E.find.cap = 0;
+  E.find.cur = -1;
+  E.find.done = 0;
+  E.find.running = 0;
+  E.find.cancel = 0;
+  E.find.finished = 0;
+  E.find.found = NULL;
+  E.find.nfound = 0;
+  E.find.foundcap = 0;
+  pthread_mutex_init(&E.find.lock, NULL);
+  if (pipe(E.find.wake) == -1)
+    die("pipe");
+  fcntl(E.find.wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.find.wake[1], F_SETFL, O_NONBLOCK);
+  E.save.gen = 0;    // no save running
+  E.save.running = 0;
+  E.save.path = NULL;
+  E.save.spans = NULL;
+  E.save.nspans = 0;
+  E.save.spancap = 0;
+  E.save.retired = NULL;
+  E.save.nretired = 0;
+  E.save.retiredcap = 0;
+  pthread_mutex_init(&E.save.lock, NULL);
+  if (pipe(E.save.wake) == -1)
+    die("pipe");
+  fcntl(E.save.wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.save.wake[1], F_SETFL, O_NONBLOCK);
+  E.undo.arena = NULL; // no history yet
+  E.undo.len = 0;
+  E.undo.cap = 0;
+  E.undo.cur = 0;
+  E.undo.merge = 0;
+  E.swap.path = NULL; // nothing journaled until a file is named
+  E.swap.fd = -1;
+  E.swap.buf = NULL;
+  E.swap.len = 0;
+  E.swap.cap = 0;
+  pthread_mutex_init(&E.swap.lock, NULL);
+  pthread_cond_init(&E.swap.cond, NULL);
+  E.rcache.e = NULL; // no row rendered yet
+  E.rcache.head = -1;
+  E.rcache.tail = -1;
+  E.rcache.free = -1;
+  E.rcache.n = 0;
+  E.rcache.bytes = 0;
+  E.rcache.tag = 0;
+  E.hl_check = NULL; // lexer checkpoints
+  E.hl_checkvalid = 0;
+  E.hl_checkcap = 0;
+  E.hl_budget = KILO_HL_BUDGET;
+  E.hl_wanted = -1;
+  E.hl_cores = 0;
+  E.screen = NULL;   // shadow of the terminal, made by the first refresh
+  E.frame = NULL;
+  E.screenh = 0;
+  E.screenw = 0;
+  E.cursory = -1;
+  E.cursorx = -1;
+  E.screenrowoff = 0;
+  E.input.head = 0;  // nothing read ahead yet
+  E.input.tail = 0;
+  E.lastframe = 0;
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1) 
     die("getWindowSize");
 
   E.screenrows -= 2;
+
+  if (pipe(E.winch) == -1)
+    die("pipe");
+  fcntl(E.winch[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.winch[1], F_SETFL, O_NONBLOCK);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleSigWinch;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
 }
 
 
+#ifndef KILO_NO_MAIN // benchmarks include this file for its internals
 int main(int argc, char *argv[]) {
   enableRawMode();
   initEditor();
+  editorSetStatusMessage(
+      "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-Z/Y = undo/redo");
   if (argc >= 2) {
     editorOpen(argv[1]);
+    editorSwapOpen();
   }
 
-  editorSetStatusMessage(
-      "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
-
   while (1) {
-    editorRefreshScreen();
+    if (editorFrameDue()) // keys that arrive together are handled before drawing
+      editorRefreshScreen();
+    else
+      editorScroll(); // paging reads rowoff, keep it current
     editorProcessKeypress();
   }
   return 0;
 }
+#endif
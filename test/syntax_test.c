@@ -0,0 +1,90 @@
+/*** syntax test ***/
+
+// Edits a C buffer while comment states are settled on several threads,
+// then checks every row starts in the state a plain top to bottom lex
+// gives it. Build and run with `make test`
+
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+#define TEST_ROWS 4000
+
+int testFailures = 0;
+
+
+void testStates(const char *step) { // every row's start state against a serial lex
+  int state = 0;
+  for (int r = 0; r < E.numrows; r++) {
+    E.hl_budget = KILO_HL_BUDGET; // no guessing, each row is settled for real
+    E.hl_wanted = -1;
+    int got = editorRowStartState(r);
+    if (got != state) {
+      printf("FAIL %s: row %d starts in state %d, want %d\n", step, r, got, state);
+      testFailures++;
+      return;
+    }
+    erow *row = editorRowAt(r);
+    state = editorLexEndState(row->chars, row->size, state);
+  }
+}
+
+
+void testShow(int at) { // draw one row as the screen would, with a frame's budget
+  E.hl_budget = KILO_HL_BUDGET;
+  E.hl_wanted = -1;
+  editorRowMaterialize(at);
+}
+
+
+void testInsert(int y, int x, char *s) {
+  E.cy = y;
+  E.cx = x;
+  editorInsertText(s, strlen(s));
+}
+
+
+int main() {
+  E.screenrows = 24;
+  E.screencols = 80;
+  E.hl_wanted = -1;
+  E.hl_cores = 4; // settle on threads even on a single core
+  E.filename = "syntax_test.c";
+  editorSelectSyntaxHighlight();
+
+  char line[64];
+  for (int r = 0; r < TEST_ROWS; r++) {
+    int len = snprintf(line, sizeof(line), "int x%d = %d;", r, r);
+    editorInsertRow(r, line, len);
+  }
+
+  // a comment opened at the top is settled past the rows between on
+  // threads, then closed again by one edit to a row in that stretch
+  testShow(0);
+  testShow(1000);
+  testInsert(0, 0, "/*");
+  testShow(2000);
+  testInsert(1000, 0, "*/");
+  testShow(3000);
+  erow *row = editorRowAt(3000);
+  if (hlGet(rowCacheHl(rowCacheGet(row)), 0) != HL_KEYWORD2) {
+    printf("FAIL: row 3000 is not drawn as code after the comment closed\n");
+    testFailures++;
+  }
+  testStates("comment closed");
+
+  // then edits anywhere, each followed by drawing a row far from it
+  static char *bits[] = {"/*", "*/", "//", "\"", "x", "\n"};
+  srand(1);
+  for (int step = 0; step < 400 && !testFailures; step++) {
+    int y = rand() % E.numrows;
+    testInsert(y, rand() % (editorRowAt(y)->size + 1), bits[rand() % 6]);
+    testShow(rand() % E.numrows);
+    if (step % 40 == 39)
+      testStates("random edits");
+  }
+
+  if (testFailures)
+    return 1;
+  printf("ok\n");
+  return 0;
+}